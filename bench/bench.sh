@@ -0,0 +1,69 @@
+#!/bin/sh
+# Benchmark suite for quash: generates a set of reproducible script
+# workloads and runs each through bench/shellbench, printing commands/sec,
+# p50/p99 latency per command and peak RSS. Other shells can be run on the same
+# scripts side by side.
+#
+# Usage: bench/bench.sh [workload ...]
+#   workloads: trivial spawn pipeline throughput jobs bigargs (default all)
+#   QUASH=path      quash binary (default ./quash)
+#   COMPARE="dash bash"  also run these shells
+#   RUNS=n          runs per workload (default 5)
+#   SCALE=n         multiplies the size of every workload (default 1)
+
+QUASH=${QUASH:-./quash}
+RUNS=${RUNS:-5}
+SCALE=${SCALE:-1}
+WORKLOADS=${*:-trivial spawn pipeline throughput jobs bigargs}
+SHELLBENCH=${SHELLBENCH:-bench/shellbench}
+DIR=${BENCH_DIR:-$(mktemp -d)}
+
+if [ ! -x "$QUASH" ]; then
+  echo "build quash first (make or make release)" >&2
+  exit 1
+fi
+if [ ! -x "$SHELLBENCH" ]; then
+  echo "build the driver first (make bench/shellbench)" >&2
+  exit 1
+fi
+
+# repeat N LINE: writes LINE N times
+repeat() {
+  awk -v n="$1" -v line="$2" 'BEGIN { for (i = 0; i < n; i++) print line }'
+}
+
+gen() {
+  case $1 in
+    # shell overhead only: a builtin every shell has
+    trivial) repeat $((100000 * SCALE)) "cd ." ;;
+    # one external command per line, by path so builtin true is not used
+    spawn) repeat $((2000 * SCALE)) "/bin/true" ;;
+    # 16 stage pipelines
+    pipeline) repeat $((200 * SCALE)) "echo x$(repeat 15 ' | cat' | tr -d '\n')" ;;
+    # bulk data through a 4 stage pipeline
+    throughput) echo "head -c $((1024 * 1024 * 1024 * SCALE)) /dev/zero | cat | cat | wc -c" ;;
+    # mass background jobs, then give them time to be reaped
+    jobs) repeat $((2000 * SCALE)) "/bin/true &"; echo "sleep 0.2" ;;
+    # lines of 5000 arguments
+    bigargs) repeat $((200 * SCALE)) "/bin/true $(repeat 5000 argument | tr '\n' ' ')" ;;
+    *) return 1 ;;
+  esac
+}
+
+printf "%-12s %-14s %8s %12s %10s %10s %10s\n" "workload" "shell" "commands" "commands/s" "p50 us" "p99 us" "maxrss KB"
+for workload in $WORKLOADS; do
+  script="$DIR/$workload.sh"
+  if ! gen "$workload" > "$script"; then
+    echo "unknown workload $workload" >&2
+    continue
+  fi
+  for shell in "$QUASH" $COMPARE; do
+    if command -v "$shell" > /dev/null 2>&1; then
+      "$SHELLBENCH" -r "$RUNS" -l "$workload" "$shell" "$script"
+    fi
+  done
+done
+
+if [ -z "$BENCH_DIR" ]; then
+  rm -rf "$DIR"
+fi
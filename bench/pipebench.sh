@@ -0,0 +1,33 @@
+#!/bin/sh
+# Pushes GB gigabytes through a 4-stage quash pipeline
+# (head | cat | cat | wc) once per pipe capacity and reports throughput.
+#
+# Usage: bench/pipebench.sh [GB] [capacity ...]
+#   capacities are anything set PIPESZ= accepts (default 64K 256K 1M)
+#   capacities above /proc/sys/fs/pipe-max-size need CAP_SYS_RESOURCE
+
+QUASH=${QUASH:-./quash}
+GB=${1:-1}
+[ $# -gt 0 ] && shift
+SIZES=${*:-default 256K 1M}
+BYTES=$((GB * 1024 * 1024 * 1024))
+
+if [ ! -x "$QUASH" ]; then
+  echo "build quash first (make)" >&2
+  exit 1
+fi
+if [ -r /proc/sys/fs/pipe-max-size ]; then
+  echo "pipe-max-size: $(cat /proc/sys/fs/pipe-max-size)"
+fi
+
+printf "%-10s %10s %10s\n" "PIPESZ" "seconds" "GB/s"
+for size in $SIZES; do
+  start=$(date +%s.%N)
+  out=$(printf 'set PIPESZ=%s\nhead -c %s /dev/zero | cat | cat | wc -c\n' "$size" "$BYTES" | "$QUASH" 2>&1)
+  end=$(date +%s.%N)
+  if [ "$(echo "$out" | tail -n 1)" != "$BYTES" ]; then
+    echo "$size: pipeline failed: $out" >&2
+    continue
+  fi
+  echo "$size $start $end $GB" | awk '{ t = $3 - $2; printf "%-10s %10.3f %10.2f\n", $1, t, $4 / t }'
+done
@@ -0,0 +1,295 @@
+/*
+  File: shellbench.c
+  Runs a shell on a script file several times and reports commands/sec,
+  p50/p99 latency per command and peak RSS, so the same workload can be
+  compared across builds of quash or against other shells. Used by
+  bench/bench.sh.
+
+  Usage: shellbench [-r runs] [-l label] shell script
+    the script is the shell's stdin, its stdout & stderr go to /dev/null.
+    Latency comes from one more run that feeds the shell a line at a time,
+    each followed by a cd that fails, and times until the shell reports
+    that failure (quash on stdout, other shells on stderr). Every shell
+    has cd, and a failing one costs a few microseconds on top of the
+    command.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// path cd is pointed at after each command, it must not exist
+#define MARKER "shellbench-marker"
+
+int compareDoubles(const void* a, const void* b)
+{
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+/*
+  Counts the non-blank lines of a script
+  @return: number of commands, negative on error
+*/
+long countCommands(const char* path)
+{
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    return -1;
+  }
+  long count = 0;
+  int blank = 1;
+  int c;
+  while ((c = getc(file)) != EOF) {
+    if (c == '\n') {
+      count += !blank;
+      blank = 1;
+    }
+    else if (c != ' ' && c != '\t') {
+      blank = 0;
+    }
+  }
+  count += !blank;
+  fclose(file);
+  return count;
+}
+
+/*
+  Runs shell once with script as its stdin
+  @param seconds: [out] wall time of the run
+  @param maxrss: [out] peak RSS in KB of the shell (or its largest child)
+  @return: 0 if the shell ran, non-zero otherwise
+*/
+int runOnce(const char* shell, const char* script, double* seconds, long* maxrss)
+{
+  int in = open(script, O_RDONLY);
+  if (in < 0) {
+    fprintf(stderr, "\nError opening %s. Error:%d\n", script, errno);
+    return -1;
+  }
+  double start = now();
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "\nError forking child. Error:%d\n", errno);
+    close(in);
+    return -1;
+  }
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(in, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    execlp(shell, shell, (char*) NULL);
+    _exit(127);
+  }
+  close(in);
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    fprintf(stderr, "\nError waiting for %s. Error:%d\n", shell, errno);
+    return -1;
+  }
+  *seconds = now() - start;
+  *maxrss = usage.ru_maxrss;
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+    fprintf(stderr, "%s: could not be run\n", shell);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+  Waits until the shell has reported the marker cd
+  @param fd: read end of the shell's stdout & stderr
+  @param carry: [in/out] tail of the last read, a marker may straddle reads
+  @return: 0 once the marker is seen, non-zero if the shell went away
+*/
+int waitForMarker(int fd, char* carry)
+{
+  size_t markerLength = strlen(MARKER);
+  char buf[4096 + sizeof(MARKER)];
+  size_t carried = strlen(carry);
+  memcpy(buf, carry, carried);
+  while (1) {
+    ssize_t numRead = read(fd, buf + carried, 4096);
+    if (numRead < 0 && errno == EINTR) {
+      continue;
+    }
+    if (numRead <= 0) {
+      return -1;
+    }
+    size_t length = carried + numRead;
+    buf[length] = '\0';
+    // command output may hold NULs, search past them
+    size_t i = 0;
+    for (; i + markerLength <= length; ++i) {
+      if (memcmp(buf + i, MARKER, markerLength) == 0) {
+        carry[0] = '\0';
+        return 0;
+      }
+    }
+    carried = length < markerLength - 1 ? length : markerLength - 1;
+    memmove(buf, buf + length - carried, carried);
+    memcpy(carry, buf, carried);
+    carry[carried] = '\0';
+  }
+}
+
+/*
+  Runs shell once, writing the script to it one command at a time and
+  timing each from being written until the shell has finished it
+  @param latencies: [out] seconds each command took, in script order
+  @param numCommands: number of non-blank lines in the script
+  @return: 0 if the shell ran, non-zero otherwise
+*/
+int runLockstep(const char* shell, const char* script, double latencies[], long numCommands)
+{
+  FILE* file = fopen(script, "re");
+  if (!file) {
+    fprintf(stderr, "\nError opening %s. Error:%d\n", script, errno);
+    return -1;
+  }
+  int in[2];
+  int out[2];
+  if (pipe(in) < 0 || pipe(out) < 0) {
+    fprintf(stderr, "\nError creating pipe. Error:%d\n", errno);
+    fclose(file);
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "\nError forking child. Error:%d\n", errno);
+    fclose(file);
+    return -1;
+  }
+  if (pid == 0) {
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(out[1], STDERR_FILENO);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    execlp(shell, shell, (char*) NULL);
+    _exit(127);
+  }
+  close(in[0]);
+  close(out[1]);
+  // a shell that dies shows up as a failed write, not a signal
+  signal(SIGPIPE, SIG_IGN);
+
+  char* line = NULL;
+  size_t lineSize = 0;
+  ssize_t length;
+  char carry[sizeof(MARKER)] = "";
+  long n = 0;
+  int ret = 0;
+  while (n < numCommands && (length = getline(&line, &lineSize, file)) > 0) {
+    if (strspn(line, " \t\n") == (size_t) length) {
+      continue;
+    }
+    double start = now();
+    if (write(in[1], line, length) != length
+        || (line[length - 1] != '\n' && write(in[1], "\n", 1) != 1)
+        || write(in[1], "cd /" MARKER "\n", strlen(MARKER) + 5) != (ssize_t) strlen(MARKER) + 5
+        || waitForMarker(out[0], carry) != 0) {
+      fprintf(stderr, "%s: stopped after %ld commands\n", shell, n);
+      ret = -1;
+      break;
+    }
+    latencies[n++] = now() - start;
+  }
+  free(line);
+  fclose(file);
+  close(in[1]);
+  close(out[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  return ret;
+}
+
+int main(int argc, char* argv[])
+{
+  int runs = 5;
+  const char* label = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:l:")) != -1) {
+    switch (opt) {
+      case 'r':
+        runs = atoi(optarg);
+        break;
+      case 'l':
+        label = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-r runs] [-l label] shell script\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind != 2 || runs < 1) {
+    fprintf(stderr, "usage: %s [-r runs] [-l label] shell script\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  const char* shell = argv[optind];
+  const char* script = argv[optind + 1];
+  if (!label) {
+    label = script;
+  }
+  long commands = countCommands(script);
+  if (commands < 0) {
+    fprintf(stderr, "\nError reading %s. Error:%d\n", script, errno);
+    return EXIT_FAILURE;
+  }
+  if (commands == 0) {
+    fprintf(stderr, "%s: no commands\n", script);
+    return EXIT_FAILURE;
+  }
+
+  double times[runs];
+  long peakRss = 0;
+  int i;
+  for (i = 0; i < runs; ++i) {
+    long maxrss;
+    if (runOnce(shell, script, &times[i], &maxrss) != 0) {
+      return EXIT_FAILURE;
+    }
+    if (maxrss > peakRss) {
+      peakRss = maxrss;
+    }
+  }
+  qsort(times, runs, sizeof(double), compareDoubles);
+  double median = times[(runs - 1) / 2];
+
+  double* latencies = malloc(commands * sizeof(double));
+  if (!latencies) {
+    fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+    return EXIT_FAILURE;
+  }
+  if (runLockstep(shell, script, latencies, commands) != 0) {
+    return EXIT_FAILURE;
+  }
+  qsort(latencies, commands, sizeof(double), compareDoubles);
+  double p50 = latencies[(commands - 1) / 2];
+  double p99 = latencies[(long) ((commands - 1) * 0.99 + 0.5)];
+  printf("%-12s %-14s %8ld %12.0f %10.1f %10.1f %10ld\n", label, shell, commands,
+         commands / median, p50 * 1e6, p99 * 1e6, peakRss);
+  free(latencies);
+  return EXIT_SUCCESS;
+}
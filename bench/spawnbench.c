@@ -0,0 +1,119 @@
+/*
+  File: spawnbench.c
+  Microbenchmark for quash's process launcher: compares spawns/sec of the
+  old fork + execvp path against posix_spawnp (what spawnCommand uses),
+  optionally with a large touched heap to show the cost of fork's page
+  table copy as the shell grows.
+
+  Usage: spawnbench [-n iterations] [-m heapMB] [command]
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+  Runs cmd n times with fork + execvp, waiting for each child
+  @return: elapsed seconds, negative on error
+*/
+double benchFork(char* cmd[], int n)
+{
+  double start = now();
+  int i;
+  for (i = 0; i < n; ++i) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      fprintf(stderr, "\nError forking child. Error:%d\n", errno);
+      return -1;
+    }
+    if (pid == 0) {
+      execvp(cmd[0], cmd);
+      _exit(EXIT_FAILURE);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+  }
+  return now() - start;
+}
+
+/*
+  Runs cmd n times with posix_spawnp, waiting for each child
+  @return: elapsed seconds, negative on error
+*/
+double benchSpawn(char* cmd[], int n)
+{
+  double start = now();
+  int i;
+  for (i = 0; i < n; ++i) {
+    pid_t pid;
+    int err = posix_spawnp(&pid, cmd[0], NULL, NULL, cmd, environ);
+    if (err != 0) {
+      fprintf(stderr, "\nError spawning %s. Error:%d\n", cmd[0], err);
+      return -1;
+    }
+    int status;
+    waitpid(pid, &status, 0);
+  }
+  return now() - start;
+}
+
+int main(int argc, char* argv[])
+{
+  int iterations = 2000;
+  long heapMB = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+    switch (opt) {
+      case 'n':
+        iterations = atoi(optarg);
+        break;
+      case 'm':
+        heapMB = atol(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n iterations] [-m heapMB] [command]\n", argv[0]);
+        return 1;
+    }
+  }
+  char* defaultCmd[] = { "true", NULL };
+  char** cmd = (optind < argc) ? argv + optind : defaultCmd;
+
+  // grow and touch the heap so fork has page tables to copy
+  char* heap = NULL;
+  if (heapMB > 0) {
+    heap = malloc(heapMB << 20);
+    if (!heap) {
+      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+      return 1;
+    }
+    memset(heap, 1, heapMB << 20);
+  }
+
+  double forkTime = benchFork(cmd, iterations);
+  double spawnTime = benchSpawn(cmd, iterations);
+  if (forkTime < 0 || spawnTime < 0) {
+    return 1;
+  }
+  printf("command: %s, iterations: %d, heap: %ld MB\n", cmd[0], iterations, heapMB);
+  printf("fork+exec:   %10.0f spawns/sec\n", iterations / forkTime);
+  printf("posix_spawn: %10.0f spawns/sec\n", iterations / spawnTime);
+  printf("speedup:     %10.2fx\n", forkTime / spawnTime);
+
+  free(heap);
+  return 0;
+}
@@ -4,972 +4,5170 @@
   EECS 678 Project 1: Quite a Shell
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <pthread.h>
+#endif
 
-int getCommand(char** cmd[], int* numArgs);
-int getCommandsFromFile(char*** cmds[], int* numArgs[], int* numCmds);
-int splitCommand(char* cmd[], char*** separated[], int* numCmds, char* separator);
+struct arena;
 
-int execCommand(char* cmd[], int numArgs, char* envp[]); 
-int execSimpleCommand(char* cmd[], char* envp[]);
-int execPipedCommand(char** cmdSet[], int numCmds, char* envp[]);
-int execRedirectedCommand(char* cmd[], int numArgs, char redirectSym, char* envp[]);
-int execBackgroundCommand(char* cmd[], char* envp[]);
-int execQuashFromFile(char* argv[], int argc, char* envp[]);
+void* quashMalloc(size_t size);
+void* quashRealloc(void* ptr, size_t size);
+void* quashCalloc(size_t count, size_t size);
+char* quashStrdup(const char* str);
+void* arenaAlloc(struct arena* arena, size_t size);
+char* arenaStrdup(struct arena* arena, const char* str);
+void arenaReset(struct arena* arena);
+void arenaFree(struct arena* arena);
+
+struct lineReader;
+
+int initReader(struct lineReader* reader, int fd);
+int mapReader(struct lineReader* reader);
+int fillReader(struct lineReader* reader);
+void releaseConsumed(struct lineReader* reader);
+int readLine(struct lineReader* reader, char** line, int* length);
+void closeReader(struct lineReader* reader);
+char* scanWord(char* p, char* end);
+char* scanSubstitutionWord(char* p, char* end);
+int parseLine(struct arena* arena, char* line, int length, char** cmd[], int* numArgs);
+struct plan;
+struct stage;
+struct stageResult;
+int getCommand(struct arena* arena, struct plan** plan);
+int compileLine(struct arena* arena, char* line, int length, struct plan** plan);
+int compilePlan(struct arena* arena, char* cmd[], int numArgs, char* text, struct plan** plan);
+int syntaxError(const char* token);
+int readHereDocs(struct arena* arena, struct plan* plan);
+struct substitution;
+int expandSubstitutions(struct arena* arena, char** cmd[], int* numArgs);
+int appendOutput(struct substitution* sub, const char* data, size_t length);
+int startSubstitution(void* ctx, int index, int outFd, pid_t* pid);
+void finishSubstitution(void* ctx, int index, int status, char* out, size_t length);
+struct globRun;
+struct dirListing;
+int expandGlobs(struct arena* arena, char** cmd[], int* numArgs);
+int hasGlobChars(const char* p, size_t length);
+int globPath(struct globRun* run, char* path, size_t length, const char* pattern, int globbed);
+int addGlobMatch(struct globRun* run, const char* path);
+struct dirListing* readDirListing(struct globRun* run, const char* dirPath);
+int addDirEntry(struct dirListing* listing, const char* name, unsigned char type);
+void freeGlobRun(struct globRun* run);
+int compareStrings(const void* a, const void* b);
+struct schedClass;
+int parseSchedClass(const char* text, struct schedClass* schedClass);
+int applySchedClass(pid_t pid, struct schedClass* schedClass);
+int spawnInSchedClass(char* cmd[], posix_spawn_file_actions_t* actions, pid_t* pid,
+                      struct schedClass* schedClass);
+void* classSpawnThread(void* arg);
+int isJobIdList(char* words[], int numWords);
+int parsePlacement(struct arena* arena, char* cmd[], int numArgs, int* i, struct stage* stage);
+#ifdef __linux__
+int parseIdList(const char* text, cpu_set_t* ids);
+struct placement;
+int applyPlacement(struct placement* placement);
+void restorePlacement(struct placement* placement);
+#endif
+struct plan* copyPlan(struct arena* arena, struct plan* plan);
+struct builtin;
+const struct builtin* findBuiltin(const char* name);
+int isBuiltin(const char* name);
+int isExternalPlan(struct plan* plan);
+
+int execCommand(struct plan* plan); 
+int waitForStages(struct plan* plan, pid_t pids[], struct stageResult* results);
+void printTimes(struct plan* plan, pid_t pids[], struct stageResult* results, struct timespec* start);
+double elapsed(struct timespec* start, struct timespec* end);
+double seconds(struct timeval* tv);
+int exitCode(int status);
+int execPipedCommand(struct plan* plan, pid_t pids[], struct stageResult* results, int outFd);
+int openRedirects(struct stage* stage, int fds[]);
+int openHereText(const char* text);
+int makeMemoryFile(const char* name);
+void runBuiltinStage(const struct builtin* builtin, struct stage* stage, int in, int out,
+                     struct stageResult* result);
+int execBackgroundCommand(struct plan* plan, pid_t pids[], int outFd);
+int execQuashFromFile(char* argv[], int argc);
+
+void initSpawnAttr();
+int spawnCommand(char* cmd[], posix_spawn_file_actions_t* actions, pid_t* pid);
+int makePipe(int fds[2]);
+int setPipeSize(int fd);
+long parseSize(const char* text);
+
+unsigned long hashString(const char* name);
+unsigned long hashBytes(const char* data, size_t length);
+char* searchPath(const char* name);
+char* lookupCommandPath(char* name);
+void forgetCommandPath(char* name);
+void clearPathCache();
+
+int initEnv(char* envp[]);
+struct envEntry;
+struct envEntry** findEnvEntry(const char* name, size_t nameLength, unsigned long hash);
+int envPut(const char* name, size_t nameLength, const char* value);
+int envSet(const char* name, const char* value);
+char* envGet(const char* name);
+void envUnset(const char* name);
+char** envBlock();
 
 int cd(char* args[]);
-int jobs();
+int jobs(char* args[]);
 int set(char* args[]);
+int hashCMD(char* args[]);
+int statsCMD(char** args);
+int exitCMD(char* args[]);
+int exportCMD(char* args[]);
+int coprocCMD(char* args[]);
+int fgCMD(char* args[]);
+struct coproc;
+struct coproc* findCoproc(const char* name);
+void finishCoproc(pid_t pid);
+void closeUnusedCoprocs(struct plan* plan);
+long long nowNs();
+void recordLatency(int which, long long ns);
 
-void exitChildHandler(int signal, siginfo_t* info, void* ctx);
+int initEventLoop();
+void childSignalHandler(int signal);
+void clearChildEvents();
+int reapChildren();
+int recordExit(pid_t pid, int status, struct rusage* usage);
+void flushJobReports();
+int waitForInput(int fd);
+void printPrompt();
+int addJob(pid_t pids[], int numPids, char* text);
+int findPidSlot(pid_t pid);
+void indexPid(pid_t pid, int jobid);
+int findJobByPid(pid_t pid);
+int finishJobProcess(int jobid, pid_t pid, int status);
+void removeJob(int jobid);
+struct job;
+void rememberFinishedJob(struct job* job);
+int growPidIndex(int numNew);
+struct outputRing;
+int captureJobOutput(int jobid, int fd);
+void drainJobOutputs();
+void readJobOutput(struct outputRing* ring);
+void appendToRing(struct outputRing* ring, const char* data, size_t length);
+void printRing(struct outputRing* ring, int empty);
+void keepJobOutput(struct job* job);
+struct outputRing* findJobOutput(int jobid, int* index);
+void freeRing(struct outputRing* ring);
+void waitForChildOrOutput();
+
+struct task;
+void stashExit(pid_t pid, int status, struct rusage* usage);
+struct exitRecord;
+int takeStashedExit(pid_t pid, struct exitRecord* record);
+void forgetUnclaimedExits();
+int claimChild(pid_t pid, int* status);
+int runTaskPool(int maxRunning, int keepOrder,
+                int (*startTask)(void* ctx, int index, int outFd, pid_t* pid),
+                void (*finishTask)(void* ctx, int index, int status, char* out, size_t length),
+                void* ctx);
+void printTask(struct task* task, int keepOrder, struct task** waiting, int* numWaiting, int* waitingSize, int* nextToPrint,
+               void (*finishTask)(void* ctx, int index, int status, char* out, size_t length), void* ctx);
+int startParallelTask(void* ctx, int index, int outFd, pid_t* pid);
+struct scriptRun;
+int execScriptParallel(int maxRunning);
+int startScriptLine(void* ctx, int index, int outFd, pid_t* pid);
+void finishScriptLine(void* ctx, int index, int status, char* out, size_t length);
+void addFailedLine(struct scriptRun* run, int lineNo, int ret, char* text);
+int execBarrierLine(struct scriptRun* run);
+void printLineOutput(int lineNo, char* out, size_t length);
+int parallelCMD(char* args[]);
 int killCMD(char** args); 
+struct waitTarget;
+int waitCMD(char* args[]);
+int bgClassCMD(char* args[]);
+int findWaitTarget(char* arg, struct waitTarget* target);
+int takeFinishedJob(long id, int byJobId, struct waitTarget* target);
 void preventProgramKill(int signal);
 void allowProgramKill(int signal); 
 
+// scheduling attributes given to a job with bg-class
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_VALUE(ioClass, level) (((ioClass) << 13) | (level))
+struct schedClass {
+  int policy; // SCHED_OTHER, SCHED_BATCH or SCHED_IDLE
+  int nice;
+  int ioPriority; // IOPRIO_VALUE, 0 to follow nice
+  char name[32]; // as given to bg-class, shown by jobs
+};
+// a spawn handed to classSpawnThread
+struct classSpawn {
+  char** cmd;
+  posix_spawn_file_actions_t* actions;
+  pid_t* pid;
+  struct schedClass* schedClass;
+  int ret;
+};
+
 struct job {
-	int pid;
+	int pid; // last process in the job's pipeline
 	int jobid;
 	char* bgcommand; 
 	int finishedFlag; 
+	pid_t* pids; // every process in the job, 0 once reaped
+	int numPids;
+	int numRunning;
+	int status; // exit status of the last process
+	int prevActive; // neighbours in the list of running jobs, -1 ends
+	int nextActive;
+	long long started; // nowNs() when the job was launched
+	int waitedFor; // 1 + index of the wait target it is, 0 when not waited for
+	struct schedClass schedClass;
+	struct outputRing* output; // captured stdout & stderr, NULL if they go to the terminal
 } ;
-struct job jobArray[1000]; 
-int jobCount = 0; 
+// exit status of a job that finished while nobody was waiting for it
+struct finishedJob {
+  int jobid;
+  pid_t pid;
+  int status;
+};
+#define MAX_FINISHED_JOBS 4096
+struct {
+  struct finishedJob* records;
+  int count;
+  int size;
+} finishedJobs;
+// job being waited for by the wait builtin
+struct waitTarget {
+  int jobid; // negative if it was not running when wait started
+  pid_t pid;
+  int status; // exit code once done
+  int done;
+};
+struct {
+  struct waitTarget* targets; // NULL when wait is not running
+  int numTargets;
+  int remaining;
+  int firstDone; // first target to finish, -1 until one does
+} waitState = { .firstDone = -1 };
+// pid index entry, pid is 0 for an empty slot and -1 for a deleted one
+struct pidSlot {
+  pid_t pid;
+  int jobid;
+};
+// jobs are indexed by job id, finished ids are reused by later jobs
+struct {
+  struct job* jobs;
+  int size; // number of slots allocated
+  int used; // number of slots ever handed out
+  int* freeIds; // stack of finished job ids ready for reuse
+  int numFree;
+  struct pidSlot* pidSlots; // open addressed pid -> job id index
+  int numPidSlots; // always a power of 2
+  int numPidSlotsUsed; // live and deleted slots
+  int activeHead; // running jobs, oldest first
+  int activeTail;
+  int numActive;
+} jobTable = { .activeHead = -1, .activeTail = -1 };
 
 // used for blocking signals
 sigset_t mask;
 sigset_t oldMask;
 
+// child exits are noticed through this fd: a signalfd for SIGCHLD on
+// linux, otherwise the read end of a pipe the SIGCHLD handler writes to
+int childEventFd = -1;
+#ifdef __linux__
+int epollFd = -1;
+int epollInputFd = -1; // input fd currently registered with epollFd
+#else
+int childEventPipe[2];
+#endif
+// last output of a background job, kept in memory instead of the terminal
+struct outputRing {
+  int jobid;
+  int fd; // read end of the pipe the job writes to, -1 once closed
+  char* buf;
+  size_t size;
+  size_t start; // oldest byte held
+  size_t length;
+  unsigned long long dropped; // bytes overwritten before anyone saw them
+  int attached; // fg is showing its output as it comes
+};
+// size of each background job's ring buffer, 0 to let jobs write to the terminal
+long jobOutputSize = 0;
+// every job's pipe, registered with epollFd as one fd
+int jobOutputEpollFd = -1;
+// output of finished jobs, oldest first
+#define MAX_KEPT_OUTPUTS 16
+struct {
+  struct outputRing* rings[MAX_KEPT_OUTPUTS];
+  int count;
+} keptOutputs;
+
+// finished job reports not yet printed
+struct {
+  char* buf;
+  size_t length;
+  size_t size;
+} jobReports;
+// reading commands from a terminal, with a prompt
+int interactive = 0;
+
+// capacity of pipes between pipeline stages, 0 for the system default
+long pipeSize = 0;
+
+// attributes shared by every spawned child (signal mask & dispositions)
+posix_spawnattr_t spawnAttr;
+
+// cache of command name -> absolute path, filled as commands are run
+struct pathEntry {
+  char* name;
+  char* path;
+  unsigned long hash;
+  long hits;
+  struct pathEntry* next;
+};
+struct {
+  struct pathEntry** buckets;
+  int numBuckets; // always a power of 2
+  int count;
+  long hits;
+  long misses;
+} pathCache;
+
+// environment passed to every command, chained by hash of the name
+struct envEntry {
+  char* entry; // NAME=value, as it goes in the block
+  size_t nameLength;
+  unsigned long hash;
+  struct envEntry* next;
+};
+struct {
+  struct envEntry** buckets;
+  int numBuckets; // always a power of 2
+  int count;
+  char** block; // every entry, NULL terminated, rebuilt when dirty
+  int dirty; // a variable changed since block was built
+} envStore;
+
+// arenas hand out memory in blocks that are all released together
+#define ARENA_BLOCK_SIZE 4096
+struct arenaBlock {
+  struct arenaBlock* next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+struct arena {
+  struct arenaBlock* head; // block currently being allocated from
+  size_t capacity; // total size of all blocks
+};
+
+// reads input a block at a time and hands out lines from its buffer
+#define READ_BLOCK_SIZE 65536
+struct lineReader {
+  int fd;
+  char* buf;
+  size_t size;
+  size_t start; // first character not yet handed out
+  size_t end; // end of data read so far
+  int eof;
+  int mapped; // buf is a private mapping of the whole input file
+  size_t released; // start of the part of the mapping still mapped
+};
+struct lineReader input;
+// mapped input is unmapped in pieces of at least this size once run
+#define MAP_RELEASE_SIZE (1 << 20)
+
+// character classes used by the tokenizer
+#define CHAR_WORD 0
+#define CHAR_BLANK 1
+#define CHAR_META 2
+const unsigned char charClass[256] = {
+  [' '] = CHAR_BLANK, ['\t'] = CHAR_BLANK,
+  ['|'] = CHAR_META, ['<'] = CHAR_META, ['>'] = CHAR_META, ['&'] = CHAR_META,
+};
+// byte-at-a-time classification of 8 characters in one word: each byte of
+// ZERO_BYTES(x) has its high bit set where that byte of x is zero
+#define ONES 0x0101010101010101ULL
+#define ZERO_BYTES(x) (((x) - ONES) & ~(x) & (ONES * 0x80))
+// metacharacter arguments point here instead of into the line
+const char* const metaTokens[256] = {
+  ['|'] = "|", ['<'] = "<", ['>'] = ">", ['&'] = "&",
+};
+
+// latency of quash's own hot paths, in power of 2 nanosecond buckets
+#define HISTOGRAM_BUCKETS 40
+struct histogram {
+  long count;
+  long long sum;
+  long long min;
+  long long max;
+  long buckets[HISTOGRAM_BUCKETS];
+};
+enum { HIST_PARSE, HIST_SPAWN, HIST_EXEC_TO_EXIT, HIST_WAIT, NUM_HISTOGRAMS };
+
+// counters & histograms shown by the stats builtin
+struct {
+  long allocations;
+  long arenaResets;
+  long commands;
+  long builtins;
+  long external;
+  long pipes;
+  struct histogram histograms[NUM_HISTOGRAMS];
+} quashStats;
+
+// cpus and NUMA memory policy a stage is pinned to
+#ifdef __linux__
+#ifndef MPOL_DEFAULT
+#define MPOL_DEFAULT 0
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#endif
+struct placement {
+  cpu_set_t cpus;
+  int memPolicy; // MPOL_DEFAULT to leave memory alone
+  unsigned long nodes; // nodes for memPolicy
+  // quash's own cpus & memory policy while the placement is applied
+  cpu_set_t savedCpus;
+  int savedPolicy;
+  unsigned long savedNodes;
+};
+#else
+struct placement {
+  int unused;
+};
+#endif
+
+// what a redirect's path holds
+enum {
+  REDIRECT_FILE, // file to open
+  REDIRECT_COPROC, // name of a coproc to read or write, from <&NAME & >&NAME
+  REDIRECT_HERE, // text to read, from <<<word or a here-document
+  REDIRECT_HERE_DOC // delimiter of a here-document whose body is not read yet
+};
+// a file opened onto one of a stage's fds before it runs
+struct redirect {
+  int fd; // STDIN_FILENO or STDOUT_FILENO in the child
+  int flags; // flags to open path with
+  char* path;
+  int kind;
+};
+// one command of a pipeline
+struct stage {
+  char** argv;
+  struct redirect* redirects; // applied in order, after the pipes
+  int numRedirects;
+  struct placement* placement; // cpus & memory given by pin, NULL for anywhere
+};
+// a compiled command line, ready to run as many times as needed
+struct plan {
+  struct stage* stages;
+  int numStages;
+  int background;
+  int cacheable; // same text always compiles to the same plan
+  int timed; // report each stage's usage when it finishes
+  struct schedClass* schedClass; // given by a bg-class prefix, NULL for normal
+  int numHereDocs; // here-documents whose bodies follow the line
+  int numBodyLines; // lines of input read as here-document bodies
+  char* text; // line the plan was compiled from
+};
+
+// how a stage of a foreground pipeline ended
+struct stageResult {
+  int done;
+  int status;
+  struct rusage usage;
+  struct timespec end;
+};
+
+// recently run lines and their plans, indexed by hash of the line
+#define PLAN_CACHE_SIZE 64
+struct planCacheEntry {
+  unsigned long hash;
+  int length;
+  struct plan* plan; // NULL when empty
+  struct arena arena; // owns plan and all of its strings
+  unsigned long seenHash; // last line that mapped here, cached if seen again
+};
+struct {
+  struct planCacheEntry entries[PLAN_CACHE_SIZE];
+  long hits;
+  long misses;
+} planCache;
+
+// processes started by the coproc builtin, redirected to with >&NAME & <&NAME
+struct coproc {
+  char* name;
+  pid_t pid; // 0 once it has exited
+  int toFd; // write end of its stdin, -1 once closed
+  int fromFd; // read end of its stdout
+};
+struct {
+  struct coproc* coprocs;
+  int count;
+  int size;
+} coprocTable;
+
+// exit statuses reaped by reapChildren for children that are not jobs
+struct exitRecord {
+  pid_t pid;
+  int status;
+  struct rusage usage;
+  struct timespec end;
+};
+struct {
+  struct exitRecord* records;
+  int count;
+  int size;
+} exitStash;
+
+// a command run by runTaskPool with its output being captured
+struct task {
+  pid_t pid; // 0 when the slot is free
+  int index; // order the task was started in
+  int outFd; // read end of the task's output pipe, -1 once closed
+  char* out;
+  size_t length;
+  size_t size;
+  int exited;
+  int status;
+};
+
+// state of a running parallel builtin
+struct parallelRun {
+  char** cmdTemplate;
+  char** args; // arguments from the command line, NULL to read them
+  struct lineReader* reader;
+  struct arena arena; // command vector of the task being started
+  struct arena templateArena; // copy of cmdTemplate when it would be overwritten
+};
+
+// a $(...) being expanded, its text grows as the command's output is added
+struct substitution {
+  struct plan* plan; // command being run
+  char* out;
+  size_t length;
+  size_t size;
+  int failed;
+};
+
+// names in a directory, read once per command by readDirListing
+struct dirEntryName {
+  size_t offset; // of the name in names
+  unsigned char type; // DT_ type, DT_UNKNOWN if the filesystem doesn't say
+};
+struct dirListing {
+  char* path;
+  unsigned long hash;
+  char* names; // every name, null terminated one after another
+  size_t namesLength;
+  size_t namesSize;
+  struct dirEntryName* entries;
+  int count; // -1 if the directory could not be read
+  int size;
+  struct dirListing* next;
+};
+// glob expansion of one command, with the directories it has read
+#define GLOB_CACHE_SIZE 64
+#define GLOB_BATCH_SIZE (256 * 1024)
+struct globRun {
+  struct arena* arena; // owns the matched paths
+  struct dirListing* listings[GLOB_CACHE_SIZE]; // by hash of the directory's path
+  char** matches; // matches of the word being expanded
+  int numMatches;
+  int size;
+  char* batch; // getdents64 buffer
+};
+#ifdef __linux__
+// record returned by getdents64
+struct linuxDirent64 {
+  unsigned long long d_ino;
+  long long d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+#endif
+
+// a script run with quash -j, a batch of lines at a time between barriers
+struct scriptLine {
+  int lineNo;
+  char* text;
+};
+struct scriptRun {
+  struct arena lineArena; // plan of the line being started
+  struct arena textArena; // text of each line in the batch
+  struct scriptLine* lines; // line started as each task of the batch
+  int size;
+  int numStarted;
+  int lineNo; // line number of the last line read
+  int numBodyLines; // here-document lines that followed it
+  int numLines; // lines run so far
+  struct plan* barrier; // line that ended the batch, NULL at end of script
+  int numFailed;
+  char* failures; // summary of failed lines
+  size_t failuresLength;
+  size_t failuresSize;
+};
+
+// builtins run inside quash, looked up with findBuiltin
+struct builtin {
+  const char* name;
+  int (*run)(char* args[]);
+};
+enum {
+  BUILTIN_EXIT, BUILTIN_QUIT, BUILTIN_CD, BUILTIN_JOBS, BUILTIN_SET,
+  BUILTIN_KILL, BUILTIN_HASH, BUILTIN_STATS, BUILTIN_PARALLEL, BUILTIN_WAIT,
+  BUILTIN_BG_CLASS, BUILTIN_EXPORT, BUILTIN_COPROC, BUILTIN_FG
+};
+const struct builtin builtins[] = {
+  [BUILTIN_EXIT] = { "exit", exitCMD },
+  [BUILTIN_QUIT] = { "quit", exitCMD },
+  [BUILTIN_CD] = { "cd", cd },
+  [BUILTIN_JOBS] = { "jobs", jobs },
+  [BUILTIN_SET] = { "set", set },
+  [BUILTIN_KILL] = { "kill", killCMD },
+  [BUILTIN_HASH] = { "hash", hashCMD },
+  [BUILTIN_STATS] = { "stats", statsCMD },
+  [BUILTIN_PARALLEL] = { "parallel", parallelCMD },
+  [BUILTIN_WAIT] = { "wait", waitCMD },
+  [BUILTIN_BG_CLASS] = { "bg-class", bgClassCMD },
+  [BUILTIN_EXPORT] = { "export", exportCMD },
+  [BUILTIN_COPROC] = { "coproc", coprocCMD },
+  [BUILTIN_FG] = { "fg", fgCMD },
+};
+// set by exit, quash stops once the current command is done
+int exitRequested = 0;
+// where a builtin's input comes from while it runs, -1 for quash's input
+int builtinInput = -1;
+
 int main(int argc, char* argv[], char* envp[])
 {
   // set up signal mask
   sigemptyset(&mask);
   sigaddset(&mask, SIGCHLD);
+  initSpawnAttr();
+  if (initEnv(envp) != 0 || initReader(&input, STDIN_FILENO) != 0 || initEventLoop() != 0) {
+    return -1;
+  }
 
   if (!isatty((fileno(stdin)))) {
     // input has been redirected (input not from terminal)
-    int ret = execQuashFromFile(argv, argc, envp);
-    return 0;
+    return execQuashFromFile(argv, argc) != 0;
   }
 
-  int numArgs = 4;
-  int ret = 0;
-  char cwd[1024]; 
+  // holds every argument of the current command, emptied before each prompt
+  struct arena cmdArena = { 0 };
+  interactive = 1;
 
   while (1) {
-    if (getcwd(cwd, sizeof(cwd)) != 0) {
-      printf("%s", cwd);
-      printf(" > "); 
-    }	
-    else {
-	   perror("getcwd error: "); 
-    }
+    reapChildren();
+    printPrompt();
     
     // read in input 
-    char** cmd = malloc(numArgs * sizeof(char*));
-    if (!cmd) {
-      fprintf(stderr, "\nAllocation error\n, Error:%d\n", errno);
-      return -1;
-    }
-    if (getCommand(&cmd, &numArgs) != 0) {
+    arenaReset(&cmdArena);
+    struct plan* plan;
+    if (getCommand(&cmdArena, &plan) != 0) {
+      if (input.eof && input.start == input.end) {
+        // control-d, nothing left to read
+        printf("\n");
+        arenaFree(&cmdArena);
+        return 0;
+      }
       // error getting command
-      free(cmd);
       continue;
     }
-
-    // determine command type
-    if (strcmp(cmd[0], "exit") == 0 || strcmp(cmd[0], "quit") == 0) {
-      // free memory and exit
-      int i;
-      for (i = 0; i < numArgs; ++i) {
-        free(cmd[i]);
-        i++;
-      }
-      free(cmd);
+    quashStats.commands++;
+    execCommand(plan);
+    forgetUnclaimedExits();
+    if (exitRequested) {
+      arenaFree(&cmdArena);
       return 0;
     }
-    else if (strcmp(cmd[0], "cd") == 0) {
-      ret = cd(cmd);
-    }
-    else if (strcmp(cmd[0], "jobs") == 0) {
-      ret = jobs();
-    }
-    else if (strcmp(cmd[0], "set") == 0) {
-      ret = set(cmd);
-    }
-    else if (strcmp(cmd[0], "kill") == 0) {
-      ret = killCMD(cmd);
-    }
-    else {
-      ret = execCommand(cmd, numArgs, envp);
-    }
+  }
+}
 
-    // free memory before getting next command
-    int i;
-    for (i = 0; i < numArgs; ++i) {
-      free(cmd[i]);
-      i++;
-    }
-    free(cmd);
+/*
+  Prints the prompt showing the current directory
+*/
+void printPrompt()
+{
+  char cwd[1024]; 
+  if (getcwd(cwd, sizeof(cwd)) != 0) {
+    printf("%s", cwd);
+    printf(" > "); 
+    fflush(stdout);
+  }	
+  else {
+	 perror("getcwd error: "); 
   }
 }
 
 /*
-  Executes quash with input from file of commands
+  Executes quash with input from file of commands, one line at a time
+  or, with -j N, up to N lines at once
   @param argv: arguments passed into main
   @param argc: number of arugments
-  @param envp: environment variables
-  @return: 0 for success, non-zero otherwise
+  @return: 0 for success, non-zero otherwise (with -j, if any line failed)
 */
-int execQuashFromFile(char* argv[], int argc, char* envp[])
+int execQuashFromFile(char* argv[], int argc)
 {
-  int ret = 0;
-  int numCmds = 1;
-  int* numArgs = malloc(numCmds * sizeof(int));
-  if (!numArgs) {
-    fprintf(stderr, "\nAllocation error\n, Error:%d\n", errno);
-    return -1;
-  }
-  memset(numArgs, '\0', numCmds);
-  char*** cmds = malloc(numCmds * sizeof(char**));
-  if (!cmds) {
-    fprintf(stderr, "\nAllocation error\n, Error:%d\n", errno);
-    return -1;
-  }
-  memset(cmds, '\0', numCmds);
+  // holds the current command, emptied before each line is read
+  struct arena cmdArena = { 0 };
 
-  // read in input
-  if (getCommandsFromFile(&cmds, &numArgs, &numCmds) != 0) {
-    // error getting command
-    free(cmds);
-    return -1;
-  }
+  // scripts in a regular file are read straight out of a mapping of it
+  mapReader(&input);
 
-  int i;
-  for(i = 0; i < numCmds; ++i) {
-    char** currCmd = cmds[i];
-    // determine command type
-    if (strcmp(currCmd[0], "exit") == 0 || strcmp(currCmd[0], "quit") == 0) {
-      // free memory and exit
-      int j = 0;
-      while (currCmd[j] != 0) {
-        free(currCmd[j]);
-        j++;
-      }
-      free(currCmd);
-      return 0;
+  // quash -j N runs up to N lines at once
+  int maxRunning = 1;
+  int i = 1;
+  for (; i < argc; ++i) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      maxRunning = atoi(argv[++i]);
     }
-    else if (strcmp(currCmd[0], "cd") == 0) {
-      ret = cd(currCmd);
-    }
-    else if (strcmp(currCmd[0], "jobs") == 0) {
-      ret = jobs();
-    }
-    else if (strcmp(currCmd[0], "set") == 0) {
-      ret = set(currCmd);
-    }
-    else {
-      ret = execCommand(currCmd, numArgs[i], envp);
+    else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] != '\0') {
+      maxRunning = atoi(argv[i] + 2);
     }
   }
+  if (maxRunning > 1) {
+    return execScriptParallel(maxRunning);
+  }
 
-  for (i = 0; i < numCmds; ++i) {
-    int j = 0;
-    for (; j < numArgs[i]; ++j) {
-      free(cmds[i][j]);
-      j++;
+  // run each line as soon as it is read, so memory use does not depend on script length
+  while (1) {
+    reapChildren();
+    arenaReset(&cmdArena);
+    struct plan* plan;
+    int ret = getCommand(&cmdArena, &plan);
+    if (ret < 0) {
+      arenaFree(&cmdArena);
+      return -1;
+    }
+    else if (ret > 0) {
+      if (input.eof && input.start == input.end) {
+        // all commands have been read
+        break;
+      }
+      // blank line or syntax error, nothing to run
+      continue;
+    }
+    quashStats.commands++;
+    execCommand(plan);
+    forgetUnclaimedExits();
+    if (exitRequested) {
+      break;
     }
-    free(cmds[i]);
-    i++;
   }
-  free(cmds);
 
+  arenaFree(&cmdArena);
   return 0;
 }
 
 /*
-  Reads input and parses into a command & its arguments
-  @param cmd: [in/out] preallocated char** of size numArgs passed by reference, 
-    will hold command and its args on return with NULL as the final value
-  @param numArgs: [in/out] number of args in cmd 
-  @return: 0 if command was successfully read in, non-zero for error
+  Counting wrapper around malloc, so stats can show how many heap
+  allocations quash itself makes per command
 */
-int getCommand(char** cmd[], int* numArgs)
+void* quashMalloc(size_t size)
 {
-  int cmdLength = 128;
-  char* unparsedCmd = malloc(cmdLength * sizeof(char));
-  if (!unparsedCmd) {
-    fprintf(stderr, "\ngetCommand allocation error, Error:%d\n", errno);
-    return -1;
-  }
-  
-  int index = 0;
-  int c;
-  // read in command
-  do {
-    c = getchar();
-    if (c == EOF || c == '\n') {
-      if (index == 0) {
-        // no command was entered
-        free(unparsedCmd);
-        return 1;
-      }
-      // reached end of input, append null
-      unparsedCmd[index] = '\0';
-      break;
-    }
-    // add character to command
-    unparsedCmd[index] = c;
-    
-    index++;
-    if (index >= cmdLength) {
-      // allocate more space for the buffer
-      cmdLength += cmdLength;
-      unparsedCmd = realloc(unparsedCmd, cmdLength * sizeof(char));
-      if (!unparsedCmd) {
-        // error in reallocation
-        fprintf(stderr, "\ngetCommand allocation error, Error:%d\n", errno);
-        return -1;
-      }
-    }
-  } while (1);
-
-  // parse command into invidual arguments
-  int argNum = 0;
-  char* arg = strtok(unparsedCmd, " ");
-  while (arg != 0) {
-    // allocate memory for string storage
-    (*cmd)[argNum] = malloc((strlen(arg) + 1) * sizeof(char));
-    if (!((*cmd)[argNum])) {
-      fprintf(stderr, "\ngetCommand allocation error, Error:%d\n", errno);
-      free(unparsedCmd);
-      return -1;
-    }
-    memset((*cmd)[argNum], '\0', (strlen(arg) + 1));
-    // NOTE: need to copy because unparsedCmd goes out of scope
-    strcpy((*cmd)[argNum], arg);
-    argNum++;
-    if (argNum >= *numArgs) {
-      // need to reallocate, double size
-      *numArgs *= 2;
-      *cmd = realloc(*cmd, (*numArgs) * sizeof(char*));
-      if (!(*cmd)) {
-        // error in reallocations
-        fprintf(stderr, "\ngetCommand allocation error, Error:%d\n", errno);
-        free(unparsedCmd);
-        return -1;
-      }
-    }
+  quashStats.allocations++;
+  return malloc(size);
+}
 
-    arg = strtok(0, " ");
-  }
-  // add one last null pointer
-  (*cmd)[argNum] = 0;
+/*
+  Counting wrapper around realloc
+*/
+void* quashRealloc(void* ptr, size_t size)
+{
+  quashStats.allocations++;
+  return realloc(ptr, size);
+}
 
-  // set numArgs to be the actual number of arguments (not size of array)
-  *numArgs = argNum;
-  // shrink command vector to exactly the size needed
-  (*cmd) = realloc(*cmd, (argNum + 1) * sizeof(char*));
+/*
+  Counting wrapper around calloc
+*/
+void* quashCalloc(size_t count, size_t size)
+{
+  quashStats.allocations++;
+  return calloc(count, size);
+}
 
-  free(unparsedCmd);
-  return 0;
+/*
+  Counting wrapper around strdup
+*/
+char* quashStrdup(const char* str)
+{
+  quashStats.allocations++;
+  return strdup(str);
 }
 
 /*
-  Reads one or more commands from a file separated by new line characters
-  @param cmds: [in/out] Preallocated array of string arrays passed in by refernece
-  @param numArgs: [in/out] Preallocated array of number of arguments for each command
-  @param numCmds: [in/out] Number of total commands read from file
-  @return: 0 for success, non zero otherwise
+  Allocates memory from an arena. Memory is only given back all at once by
+  arenaReset, so allocation is a pointer bump in the common case.
+  @param arena: arena to allocate from
+  @param size: number of bytes needed
+  @return: pointer to the memory, NULL on allocation error
 */
-int getCommandsFromFile(char*** cmds[], int* numArgs[], int* numCmds)
+void* arenaAlloc(struct arena* arena, size_t size)
 {
-  int endOfFile = 0;
-  int cmdNum = 0;
-  while (!endOfFile) {
-    int cmdLength = 128;
-    char* unparsedCmd = malloc(cmdLength * sizeof(char));
-    if (!unparsedCmd) {
-      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
-      return -1;
+  // keep every allocation pointer aligned
+  size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  struct arenaBlock* block = arena->head;
+  if (!block || block->used + size > block->size) {
+    // start a new block at least twice as big as the last one
+    size_t blockSize = block ? block->size * 2 : ARENA_BLOCK_SIZE;
+    while (blockSize < size) {
+      blockSize *= 2;
     }
-    
-    int index = 0;
-    int c;
-    // read in command
-    do {
-      c = getchar();
-      if (c == EOF) {
-        if (index == 0 && cmdNum == 0) {
-          // no command in file
-          return -1; 
-        }
-        else if (index == 0) {
-          // all commands have been read
-          *numCmds = cmdNum;
-          return 0;
-        }
-        unparsedCmd[index] = '\0';
-        endOfFile = 1;
-        break;
-      }
-      else if(c == '\n') {
-        if (index == 0) {
-          // no command was entered
-          // start over on reading
-          continue;
-        }
-        // reached end of input, append null
-        unparsedCmd[index] = '\0';
-        break;
-      }
-      // add character to command
-      unparsedCmd[index] = c;
-      
-      index++;
-      if (index >= cmdLength) {
-        // allocate more space for the buffer
-        cmdLength += cmdLength;
-        unparsedCmd = realloc(unparsedCmd, cmdLength * sizeof(char));
-        if (!unparsedCmd) {
-          // error in reallocation
-          fprintf(stderr, "\nReallocation error, Error:%d\n", errno);
-          return -1;
-        }
-      }
-    } while (1);
-
-    // allocate command vector
-    int currNumArgs = 2;
-    (*cmds)[cmdNum] = malloc(currNumArgs * sizeof(char*));
-    if (!(*cmds)[cmdNum]) {
-      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
-      return -1;
+    block = quashMalloc(sizeof(struct arenaBlock) + blockSize);
+    if (!block) {
+      fprintf(stderr, "\nArena allocation error, Error:%d\n", errno);
+      return NULL;
     }
-    memset((*cmds)[cmdNum], '\0', currNumArgs);
+    block->size = blockSize;
+    block->used = 0;
+    block->next = arena->head;
+    arena->head = block;
+    arena->capacity += blockSize;
+  }
+  void* mem = block->data + block->used;
+  block->used += size;
+  return mem;
+}
 
-    // parse command into invidual arguments
-    int argNum = 0;
-    char* arg = strtok(unparsedCmd, " ");
-    while (arg != 0) {
-      // allocate memory for string storage
-      (*cmds)[cmdNum][argNum] = malloc((strlen(arg) + 1) * sizeof(char));
-      if (!((*cmds)[cmdNum][argNum])) {
-        fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
-        return -1;
-      }
-      memset((*cmds)[cmdNum][argNum], '\0', (strlen(arg) + 1));
-      // NOTE: need to copy because unparsedCmd goes out of scope
-      strcpy((*cmds)[cmdNum][argNum], arg);
-      argNum++;
-      if (argNum >= currNumArgs) {
-        // need to reallocate, double size
-        currNumArgs *= 2;
-        (*cmds)[cmdNum] = realloc((*cmds)[cmdNum], (currNumArgs) * sizeof(char*));
-        if (!(*cmds)[cmdNum]) {
-          // error in reallocations
-          fprintf(stderr, "\nReallocation error, Error:%d\n", errno);
-          return -1;
-        }
-      }
-      arg = strtok(0, " ");
-    }
-    // add one last null pointer
-    (*cmds)[cmdNum][argNum] = 0;
-    // set numArgs to be number of arguments for current command
-    (*numArgs)[cmdNum] = argNum;
-    //shrink command to exactly size needed
-    (*cmds)[cmdNum] = realloc((*cmds)[cmdNum], (argNum + 1) * sizeof(char*));
-
-    free(unparsedCmd);
-    // check to see if we need to allocate for more commands
-    cmdNum++;
-    if (cmdNum >= *numCmds) {
-      *numCmds *= 2;
-      (*cmds) = realloc((*cmds), (*numCmds) * sizeof(char**));
-      if (!(*cmds)) {
-        // error in reallocations
-        fprintf(stderr, "\nReallocation error, Error:%d\n", errno);
-        return -1;
-      }
-      (*numArgs) = realloc((*numArgs), (*numCmds) * sizeof(int));
-      if (!(*numArgs)) {
-        // error in reallocations
-        fprintf(stderr, "\nReallocation error, Error:%d\n", errno);
-        return -1;
-      }
+/*
+  Copies a string into an arena
+  @param arena: arena to allocate from
+  @param str: string to copy
+  @return: the copy, NULL on allocation error
+*/
+char* arenaStrdup(struct arena* arena, const char* str)
+{
+  size_t length = strlen(str) + 1;
+  char* copy = arenaAlloc(arena, length);
+  if (copy) {
+    memcpy(copy, str, length);
+  }
+  return copy;
+}
+
+/*
+  Releases everything allocated from an arena at once. If the last use
+  needed several blocks they are merged into one big enough block, so an
+  arena that is reused for similar commands stops calling malloc entirely.
+  @param arena: arena to reset
+*/
+void arenaReset(struct arena* arena)
+{
+  quashStats.arenaResets++;
+  if (arena->head && arena->head->next) {
+    size_t capacity = arena->capacity;
+    arenaFree(arena);
+    struct arenaBlock* block = quashMalloc(sizeof(struct arenaBlock) + capacity);
+    if (!block) {
+      return;
     }
+    block->size = capacity;
+    block->next = NULL;
+    arena->head = block;
+    arena->capacity = capacity;
   }
-  *numCmds = cmdNum;
-  // shrink command array to exactly size needed
-  *cmds = realloc(*cmds, cmdNum * sizeof(char**));
-  return 0;
+  if (arena->head) {
+    arena->head->used = 0;
+  }
+}
+
+/*
+  Frees all memory owned by an arena
+  @param arena: arena to free
+*/
+void arenaFree(struct arena* arena)
+{
+  while (arena->head) {
+    struct arenaBlock* next = arena->head->next;
+    free(arena->head);
+    arena->head = next;
+  }
+  arena->capacity = 0;
 }
 
 /*
-  Splits command into several command vectors around separator provided
-  @param cmd: [in] command to remove pipes from
-  @param separated: [out] array of command vectors
-  @param numCmds: [out] number of separate commands
-  @param separator: [in] symbol to separate commands by (e.g. |, <, >)
+  Sets up a reader that reads fd a block at a time
+  @param reader: reader to initialize
+  @param fd: file descriptor to read lines from
   @return: 0 for success, non-zero otherwise
 */
-int splitCommand(char* cmd[], char*** separated[], int* numCmds, char* separator)
-{
-  int lastIndex = 0; // keeps track of beginning of last command copied
-  int index = 0; // keeps track of current place in original command
-  int cmdVector = 0; 
-  (*numCmds) = 0;
-  // read each argument of command
-  while (cmd[index] != 0) {
-    if (strcmp(cmd[index], separator) == 0) {
-      // allocate memory for command
-      (*separated)[cmdVector] = malloc(((index - lastIndex) + 1) * sizeof(char*));
-      if (!((*separated)[cmdVector])) {
-        fprintf(stderr, "\nsplitCommand allocation error, Error:%d\n", errno);
-        return -1;
-      }
-      memset((*separated)[cmdVector], '\0', ((index - lastIndex) + 1));
+int initReader(struct lineReader* reader, int fd)
+{
+  reader->fd = fd;
+  reader->size = READ_BLOCK_SIZE;
+  reader->start = 0;
+  reader->end = 0;
+  reader->eof = 0;
+  reader->mapped = 0;
+  reader->released = 0;
+  reader->buf = quashMalloc(reader->size);
+  if (!reader->buf) {
+    fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+    return -1;
+  }
+  return 0;
+}
 
-      int arg = 0;
-      // copy each string up to pipe into command vector of separated
-      for(; lastIndex < index; ++lastIndex, ++arg) {
-        // allocate memory for string in command
-        (*separated)[cmdVector][arg] = malloc((strlen(cmd[lastIndex]) + 1) * sizeof(char));
-        if (!((*separated)[cmdVector][arg])) {
-          fprintf(stderr, "\nsplitCommand allocation error, Error:%d\n", errno);
-          return -1;
-        }
-        memset((*separated)[cmdVector][arg], '\0', (strlen(cmd[lastIndex]) + 1));
-        // copy string 
-        strcpy((*separated)[cmdVector][arg], cmd[lastIndex]);
-      }
-      (*separated)[cmdVector][arg] = 0;
-      lastIndex = index + 1;
-      cmdVector++;
-      (*numCmds)++;
-    }
-    index++;
+/*
+  Switches a reader over to reading straight out of a mapping of its file
+  when its fd is a regular file. Lines are then parsed in place in the
+  mapping with no read calls or copies. The mapping is private so nulls
+  can be written into it, and pages are unmapped once they have been
+  run, which keeps memory use flat however long the script is.
+  @param reader: reader with nothing read yet
+  @return: 0 if the file was mapped, non-zero if the reader is unchanged
+*/
+int mapReader(struct lineReader* reader)
+{
+  struct stat info;
+  if (fstat(reader->fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+    return -1;
   }
-  // copy last command
-  // allocate memory for command
-  (*separated)[cmdVector] = malloc((index - lastIndex + 1) * sizeof(char*));
-  if (!((*separated)[cmdVector])) {
-    fprintf(stderr, "\nsplitCommand allocation error, Error:%d\n", errno);
+  off_t offset = lseek(reader->fd, 0, SEEK_CUR);
+  if (offset < 0 || offset >= info.st_size) {
     return -1;
   }
-  memset((*separated)[cmdVector], '\0', (index - lastIndex + 1));
-
-  int arg = 0;
-  // copy each string up to pipe into command vector of separated
-  for(; lastIndex < index; ++lastIndex, ++arg) {
-    // allocate memory for string in command
-    (*separated)[cmdVector][arg] = malloc((strlen(cmd[lastIndex]) + 1) * sizeof(char));
-    if (!((*separated)[cmdVector][arg])) {
-      fprintf(stderr, "\nsplitCommand allocation error, Error:%d\n", errno);
-      return -1;
-    }
-    memset((*separated)[cmdVector][arg], '\0', (strlen(cmd[lastIndex]) + 1));
-    // copy string 
-    strcpy((*separated)[cmdVector][arg], cmd[lastIndex]);
+  // mappings have to start on a page boundary
+  off_t pageOffset = offset & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+  size_t length = info.st_size - pageOffset;
+  char* map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, reader->fd, pageOffset);
+  if (map == MAP_FAILED) {
+    return -1;
   }
-  (*separated)[cmdVector][arg] = 0;
-  (*numCmds)++;
+  posix_madvise(map, length, POSIX_MADV_SEQUENTIAL);
+  // the whole file counts as read, commands reading stdin see end of file
+  lseek(reader->fd, 0, SEEK_END);
+
+  free(reader->buf);
+  reader->buf = map;
+  reader->size = length;
+  reader->start = offset - pageOffset;
+  reader->end = length;
+  reader->released = 0;
+  reader->mapped = 1;
   return 0;
 }
 
 /*
-  Determines type of command to execute and calls approriated executor
-  @param cmd: cmd with args to execute
-  @param numArgs: number of arguments in command (including command itself)
-  @param envp: array of environment variables to pass to command
-  @return: 0 for success, non-zero for failure
+  Unmaps the pages of a mapped reader that every line handed out so far
+  has finished with
+  @param reader: reader to release pages from
 */
-int execCommand(char* cmd[], int numArgs, char* envp[])
+void releaseConsumed(struct lineReader* reader)
 {
-  // search command for pipes & redirects
-  int redirectInFlag = 0;
-  int redirectOutFlag = 0;
-  int pipeFlag = 0;
-  int bgFlag = 0; 
-  int i = 0;
-  while (cmd[i] != 0) {
-    if (strcmp(cmd[i], "|") == 0) {
-      pipeFlag = 1;
-    }
-    else if (strcmp(cmd[i], "<") == 0) {
-      redirectInFlag = 1;
-    }
-    else if (strcmp(cmd[i], ">") == 0) {
-      redirectOutFlag = 1;
-    }
-    else if (strcmp(cmd[i], "&") == 0) {
-      bgFlag = 1;
-    }
-    i++;
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  size_t consumed = reader->start & ~(pageSize - 1);
+  if (reader->mapped && consumed - reader->released >= MAP_RELEASE_SIZE) {
+    munmap(reader->buf + reader->released, consumed - reader->released);
+    reader->released = consumed;
   }
+}
 
-  int ret = 0;
-  // we have access to numArgs here and this will be portable
-  if (bgFlag) {
-    // replace final & with null
-    free(cmd[numArgs - 1]);
-    cmd[numArgs - 1] = 0;
-    ret = execBackgroundCommand(cmd, envp);
-  } 
-  else if (redirectInFlag || redirectOutFlag) {
-    if (redirectInFlag == 1) {
-      ret = execRedirectedCommand(cmd, numArgs, '<', envp);
-    }
-    else {
-      // redirecting out
-      ret = execRedirectedCommand(cmd, numArgs, '>', envp);
-    }
-  }
-  else if (pipeFlag) {
-    // parse into pieces between pipes
-    char*** unpipedCmds = malloc(numArgs * sizeof(char**));
-    if (!unpipedCmds) {
-      fprintf(stderr, "\nAllocation error\n, Error:%d\n", errno);
+/*
+  Reads more input into a reader's buffer, making room first by moving
+  the unfinished line to the front or growing the buffer
+  @param reader: reader to fill
+  @return: 0 for success (including end of input), negative for error
+*/
+int fillReader(struct lineReader* reader)
+{
+  if (reader->mapped) {
+    // whole file is already in the mapping, only the last line can be left.
+    // move it into a buffer with room for its null
+    size_t remaining = reader->end - reader->start;
+    char* buf = quashMalloc(remaining + READ_BLOCK_SIZE);
+    if (!buf) {
+      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
       return -1;
     }
-    memset(unpipedCmds, '\0', numArgs * sizeof(char**));
-    int numCmds;
-    if (splitCommand(cmd, &unpipedCmds, &numCmds, "|") != 0) {
-      fprintf(stderr, "\nError in splitCommand\n");
+    memcpy(buf, reader->buf + reader->start, remaining);
+    munmap(reader->buf + reader->released, reader->size - reader->released);
+    reader->buf = buf;
+    reader->size = remaining + READ_BLOCK_SIZE;
+    reader->start = 0;
+    reader->end = remaining;
+    reader->eof = 1;
+    reader->mapped = 0;
+    return 0;
+  }
+  if (reader->start > 0) {
+    memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+  }
+  if (reader->end == reader->size) {
+    // line is longer than the buffer, double size
+    char* grown = quashRealloc(reader->buf, reader->size * 2);
+    if (!grown) {
+      fprintf(stderr, "\nreadLine allocation error, Error:%d\n", errno);
       return -1;
     }
-
-    // call execPipedCommand with array of commands and number of commands
-    ret = execPipedCommand(unpipedCmds, numCmds, envp);
-
-    // free up memory
-    int i = 0;
-    while (unpipedCmds[i] != 0) {
-      int j = 0;
-      while (unpipedCmds[i][j] != 0) {
-        free(unpipedCmds[i][j]);
-        j++;
-      }
-      free(unpipedCmds[i]);
-      i++;
-    }
-    free(unpipedCmds);
+    reader->buf = grown;
+    reader->size *= 2;
   }
-  else {
-    ret = execSimpleCommand(cmd, envp);
+  // children can finish while we wait for more input
+  if (waitForInput(reader->fd) != 0) {
+    return -1;
   }
-  return ret;
+  ssize_t numRead;
+  do {
+    numRead = read(reader->fd, reader->buf + reader->end, reader->size - reader->end);
+  } while (numRead < 0 && errno == EINTR);
+  if (numRead < 0) {
+    fprintf(stderr, "\nError reading input. Error:%d\n", errno);
+    return -1;
+  }
+  if (numRead == 0) {
+    reader->eof = 1;
+  }
+  reader->end += numRead;
+  return 0;
 }
 
 /*
-  Executes command without pipes, redirection, or background instruction
-  @param cmd: cmd with args to execute
-  @param envp: environment variables
-  @return: 0 for success, non-zero otherwise
+  Reads one line of input. The line is not copied: it points into the
+  reader's buffer with its newline replaced by a null, and stays valid
+  until the next call. Works the same whether fd is a tty, pipe or file,
+  a tty just hands back one line per read.
+  @param reader: reader to take the line from
+  @param line: [out] start of the line
+  @param length: [out] number of characters read, not including the null
+  @return: 0 if a line was read, 1 on end of input with nothing read,
+    negative for error
 */
-int execSimpleCommand(char* cmd[], char* envp[])
+int readLine(struct lineReader* reader, char** line, int* length)
 {
-  //prevent control-c from killing quash
-  signal(SIGINT, preventProgramKill);	 
-  int status;
-  pid_t pid;
-  pid = fork();
-  if (pid < 0) {
-    fprintf(stderr, "\nError forking child. Error:%d\n", errno);
-    exit(EXIT_FAILURE);
-  }
-  if (pid == 0) {
-    // child process
-    #ifdef __linux__
-    if (execvpe(cmd[0], cmd, envp) < 0) {
-    #endif
-    #ifdef __APPLE__
-    if (execvP(cmd[0], getenv("PATH"), cmd) < 0) {
-    #endif
-      if (errno == 2) {
-        fprintf(stderr, "\n%s not found.\n", cmd[0]);
+  // previous line is done with, its memory can go
+  releaseConsumed(reader);
+  while (1) {
+    char* start = reader->buf + reader->start;
+    char* newline = memchr(start, '\n', reader->end - reader->start);
+    if (newline) {
+      *newline = '\0';
+      *line = start;
+      *length = newline - start;
+      reader->start += *length + 1;
+      return 0;
+    }
+    if (reader->eof) {
+      if (reader->start == reader->end) {
+        return 1;
       }
-      else {
-        fprintf(stderr, "\nError execing %s. Error#%d\n", cmd[0], errno);
+      // last line has no newline, make sure there is room for the null
+      if ((reader->end == reader->size || reader->mapped) && fillReader(reader) != 0) {
+        return -1;
       }
-      exit(EXIT_FAILURE);
-    }
-    exit(0);
-  }
-  else {
-    // parent process
-    if (waitpid(pid, &status, 0) < 0) {
-      fprintf(stderr, "\nError in child process %d. Error#%d\n", pid, errno);
-      signal(SIGINT, allowProgramKill);
-      return 1;
+      reader->buf[reader->end] = '\0';
+      *line = reader->buf + reader->start;
+      *length = reader->end - reader->start;
+      reader->start = reader->end;
+      return 0;
     }
-    if (WIFEXITED(status)) {
-      if (WEXITSTATUS(status) == EXIT_FAILURE) {
-        return 2;
-      }
+    if (fillReader(reader) != 0) {
+      return -1;
     }
-    //control c can terminate entire quash again
-    signal(SIGINT, allowProgramKill);
-    return 0;
   }
 }
 
-//when quash is execing a command, it cannot be killed.
-void preventProgramKill(int signal)
+/*
+  Closes a reader's fd and frees its buffer
+  @param reader: reader to close
+*/
+void closeReader(struct lineReader* reader)
 {
-	printf("\n");
-} 
-
-//when program is outside of execing a command, it can be killed
-void allowProgramKill(int signal)
+#ifdef __linux__
+  if (epollInputFd == reader->fd) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, reader->fd, NULL);
+    epollInputFd = -1;
+  }
+#endif
+  if (reader->mapped) {
+    munmap(reader->buf + reader->released, reader->size - reader->released);
+  }
+  else {
+    free(reader->buf);
+  }
+  close(reader->fd);
+}
+
+/*
+  Finds the first blank or metacharacter (or the end of the line) at or
+  after p. Ordinary characters are skipped 8 at a time by testing a whole
+  word for any of the special bytes at once.
+  @param p: place in a null terminated line to start scanning from
+  @param end: the line's null terminator
+  @return: pointer to the first special character, or end
+*/
+char* scanWord(char* p, char* end)
 {
-	printf("\n");
-	exit(0); 
-} 
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (p + 8 <= end) {
+    unsigned long long word;
+    memcpy(&word, p, 8);
+    unsigned long long found = ZERO_BYTES(word ^ (ONES * ' '))
+      | ZERO_BYTES(word ^ (ONES * '\t'))
+      | ZERO_BYTES(word ^ (ONES * '|'))
+      | ZERO_BYTES(word ^ (ONES * '<'))
+      | ZERO_BYTES(word ^ (ONES * '>'))
+      | ZERO_BYTES(word ^ (ONES * '&'));
+    if (found) {
+      // the lowest flagged byte is always a real match
+      return p + (__builtin_ctzll(found) >> 3);
+    }
+    p += 8;
+  }
+#endif
+  while (p < end && charClass[(unsigned char) *p] == CHAR_WORD) {
+    p++;
+  }
+  return p;
+}
 
 /*
-  Executes command containing one or more pipes
-  @param cmdSet: array of command vectors to execute
-  @param numCmds: number of total piped commands
-  @param envp: environment variables
-  @return: 0 for success, non-zero otherwise
+  Finds the end of a word that may hold $(...) command substitutions,
+  whose commands can contain blanks and metacharacters of their own.
+  Only used for lines with a $( in them.
+  @param p: start of the word
+  @param end: the line's null terminator
+  @return: pointer to the first blank or metacharacter outside of any
+    substitution, or end
 */
-int execPipedCommand(char** cmdSet[], int numCmds, char* envp[])
+char* scanSubstitutionWord(char* p, char* end)
 {
-  signal(SIGINT, preventProgramKill);	 
-  int status;
-  int numPipes = numCmds - 1;
-  pid_t pids[numCmds];
-  // create all pipes
-  int pipefds[numPipes * 2];
-  int i = 0;
-  for (; i < numPipes; ++i) {
-    if (pipe(pipefds + (i * 2)) < 0) {
-      fprintf(stderr, "\nError creating pipe %d. Error:%d\n", (i * 2), errno);
-      return -1;
+  int depth = 0;
+  for (; p < end; ++p) {
+    if (*p == '$' && p + 1 < end && p[1] == '(') {
+      depth++;
+      p++;
+    }
+    else if (depth > 0 && *p == '(') {
+      depth++;
+    }
+    else if (depth > 0 && *p == ')') {
+      depth--;
+    }
+    else if (depth == 0 && charClass[(unsigned char) *p] != CHAR_WORD) {
+      break;
     }
   }
+  return p;
+}
 
-  // fork all child processes
-  int j = 0;
-  for (; j < numCmds; ++j) {
-    pids[j] = fork();
-    if (pids[j] < 0) {
-      fprintf(stderr, "\nError forking child %d. Error:%d\n", j, errno);
-      exit(EXIT_FAILURE);
-    }
-    else if (pids[j] == 0) {
-      // if not first command, set up input pipe
-      if (j != 0) {
-        if (dup2(pipefds[(j - 1) * 2], STDIN_FILENO) < 0) {
-          fprintf(stderr, "\nError setting stdin to pipe %d. Error:%d\n", ((j - 1) * 2), errno);
-          exit(EXIT_FAILURE);
-        }
-      }
-      // if not last command, set up output pipe
-      if (j != numCmds - 1) {
-        if (dup2(pipefds[(j * 2) + 1], STDOUT_FILENO) < 0) {
-          fprintf(stderr, "\nError setting stdout to pipe %d. Error:%d\n", ((j * 2) + 1), errno);
-          exit(EXIT_FAILURE);
-        }
+/*
+  Parses a line into a command & its arguments without copying them:
+  each argument points into the line itself, which gets a null written
+  after every argument. Metacharacters (| < > &) are split out even when
+  not surrounded by spaces and point to constant strings. A $(...) is kept
+  whole inside its word for expandSubstitutions.
+  @param arena: arena that will own the command vector
+  @param line: null terminated line, modified in place and must outlive cmd
+  @param length: length of the line
+  @param cmd: [out] command and its args with NULL as the final value
+  @param numArgs: [out] number of args in cmd
+  @return: 0 if the line held a command, 1 if it was blank, negative for error
+*/
+int parseLine(struct arena* arena, char* line, int length, char** cmd[], int* numArgs)
+{
+  int maxArgs = length / 4 + 8;
+  *cmd = arenaAlloc(arena, maxArgs * sizeof(char*));
+  if (!(*cmd)) {
+    return -1;
+  }
+
+  int argNum = 0;
+  char* p = line;
+  char* end = line + length;
+  int substitutions = memmem(line, length, "$(", 2) != NULL;
+  while (1) {
+    // skip blanks between arguments
+    while (p < end && charClass[(unsigned char) *p] == CHAR_BLANK) {
+      p++;
+    }
+    if (p >= end) {
+      break;
+    }
+    if (argNum + 1 >= maxArgs) {
+      // need room for more arguments, double size
+      char** grown = arenaAlloc(arena, maxArgs * 2 * sizeof(char*));
+      if (!grown) {
+        return -1;
       }
-      // close all pipes
-      i = 0;
-      for (; i < numPipes * 2; ++i) {
-        close(pipefds[i]);
+      memcpy(grown, *cmd, argNum * sizeof(char*));
+      *cmd = grown;
+      maxArgs *= 2;
+    }
+    if (charClass[(unsigned char) *p] == CHAR_META) {
+      (*cmd)[argNum++] = (char*) metaTokens[(unsigned char) *p];
+      p++;
+      continue;
+    }
+    (*cmd)[argNum++] = p;
+    p = substitutions ? scanSubstitutionWord(p, end) : scanWord(p, end);
+    if (p < end && charClass[(unsigned char) *p] == CHAR_META) {
+      // metacharacter right after a word, leave it to be read next
+      char meta = *p;
+      *p = '\0';
+      (*cmd)[argNum++] = (char*) metaTokens[(unsigned char) meta];
+      p++;
+      continue;
+    }
+    *p = '\0';
+    p++;
+  }
+  // add one last null pointer
+  (*cmd)[argNum] = 0;
+  *numArgs = argNum;
+  return (argNum == 0) ? 1 : 0;
+}
+
+/*
+  Reads input and compiles it into an execution plan
+  @param arena: arena that will own the plan if it is not a cached one
+  @param plan: [out] plan to run
+  @return: 0 if command was successfully read in, non-zero for error
+*/
+int getCommand(struct arena* arena, struct plan** plan)
+{
+  char* line;
+  int length;
+  int ret = readLine(&input, &line, &length);
+  if (ret != 0) {
+    return ret;
+  }
+  long long start = nowNs();
+  ret = compileLine(arena, line, length, plan);
+  recordLatency(HIST_PARSE, nowNs() - start);
+  if (ret == 0 && (*plan)->numHereDocs > 0) {
+    // reading on can move or unmap the line the plan points into
+    *plan = copyPlan(arena, *plan);
+    if (!(*plan)) {
+      return -1;
+    }
+    ret = readHereDocs(arena, *plan);
+  }
+  return ret;
+}
 
+/*
+  Reads the body of each here-document of a plan from input, the lines
+  after the command up to a line holding only the delimiter
+  @param arena: arena that will own the bodies
+  @param plan: plan with numHereDocs still to read, owned by arena
+  @return: 0 for success, positive if input ended first, negative for error
+*/
+int readHereDocs(struct arena* arena, struct plan* plan)
+{
+  int i;
+  for (i = 0; i < plan->numStages; ++i) {
+    struct stage* stage = &plan->stages[i];
+    int j;
+    for (j = 0; j < stage->numRedirects; ++j) {
+      struct redirect* redirect = &stage->redirects[j];
+      if (redirect->kind != REDIRECT_HERE_DOC) {
+        continue;
       }
-      // execute command
-      #ifdef __linux__
-      if (execvpe(cmdSet[j][0], cmdSet[j], envp) < 0) {
-      #elif __APPLE__
-      if (execvP(cmdSet[j][0], getenv("PATH"), cmdSet[j]) < 0) {
-      #endif
-        if (errno == 2) {
-          fprintf(stderr, "\n%s not found.\n", cmdSet[j][0]);
+      char* body = NULL;
+      size_t length = 0;
+      size_t size = 0;
+      while (1) {
+        if (interactive) {
+          printf("> ");
+          fflush(stdout);
         }
-        else {
-          fprintf(stderr, "\nError execing %s. Error#%d\n", cmdSet[j][0], errno);
+        char* line;
+        int lineLength;
+        int ret = readLine(&input, &line, &lineLength);
+        if (ret != 0) {
+          fprintf(stderr, "here-document ended by end of input, wanted '%s'\n", redirect->path);
+          free(body);
+          return ret;
+        }
+        plan->numBodyLines++;
+        if (strcmp(line, redirect->path) == 0) {
+          break;
         }
-        exit(EXIT_FAILURE);
+        if (length + lineLength + 1 > size) {
+          size_t newSize = size ? size * 2 : 4096;
+          while (newSize < length + lineLength + 1) {
+            newSize *= 2;
+          }
+          char* grown = quashRealloc(body, newSize);
+          if (!grown) {
+            fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+            free(body);
+            return -1;
+          }
+          body = grown;
+          size = newSize;
+        }
+        memcpy(body + length, line, lineLength);
+        body[length + lineLength] = '\n';
+        length += lineLength + 1;
+      }
+      redirect->path = arenaAlloc(arena, length + 1);
+      if (!redirect->path) {
+        free(body);
+        return -1;
       }
-      printf("Process %d exiting", (j + 1));
-    signal(SIGINT, allowProgramKill);
-      exit(0);
+      memcpy(redirect->path, body, length);
+      redirect->path[length] = '\0';
+      redirect->kind = REDIRECT_HERE;
+      free(body);
     }
   }
+  plan->numHereDocs = 0;
+  return 0;
+}
 
-  // close all pipes
-  i = 0;
-  for (; i < numPipes * 2; ++i) {
-    close(pipefds[i]);
+/*
+  Turns a line into an execution plan. A line that was run before is
+  looked up in the plan cache and reused without being tokenized again.
+  Lines are only cached the second time they are seen, so scripts made of
+  one-off lines don't pay to copy every plan into the cache.
+  @param arena: arena that will own the plan if it is not a cached one
+  @param line: null terminated line, tokenized in place when not cached
+  @param length: length of the line
+  @param plan: [out] plan to run, must not be modified when cached
+  @return: 0 for success, positive if the line was blank or had a syntax
+    error, negative for error
+*/
+int compileLine(struct arena* arena, char* line, int length, struct plan** plan)
+{
+  unsigned long hash = hashBytes(line, length);
+  struct planCacheEntry* entry = &planCache.entries[hash & (PLAN_CACHE_SIZE - 1)];
+  if (entry->plan && entry->hash == hash && entry->length == length
+      && memcmp(entry->plan->text, line, length) == 0) {
+    planCache.hits++;
+    *plan = entry->plan;
+    return 0;
   }
+  planCache.misses++;
 
-  // wait for all children
-  i = 0;
-  for (; i < numCmds; ++i) {
-    if (waitpid(pids[i], &status, 0) < 0) {
-      fprintf(stderr, "\nError in child process %d. Error#%d\n", pids[i], errno);
-      signal(SIGINT, allowProgramKill);
-      return -1;
+  // keep the line as typed, tokenizing writes nulls into it
+  char* text = arenaAlloc(arena, length + 1);
+  if (!text) {
+    return -1;
+  }
+  memcpy(text, line, length + 1);
+  char** cmd;
+  int numArgs;
+  int ret = parseLine(arena, line, length, &cmd, &numArgs);
+  if (ret != 0) {
+    return ret;
+  }
+  // output of $(...) and files matching a pattern differ from run to
+  // run, so those lines are never cached
+  int substitutions = memmem(text, length, "$(", 2) != NULL;
+  if (substitutions && (ret = expandSubstitutions(arena, &cmd, &numArgs)) != 0) {
+    return ret;
+  }
+  int globs = substitutions || hasGlobChars(text, length);
+  if (globs && (ret = expandGlobs(arena, &cmd, &numArgs)) != 0) {
+    return ret;
+  }
+  ret = compilePlan(arena, cmd, numArgs, text, plan);
+  if (ret != 0) {
+    return ret;
+  }
+  if (globs) {
+    (*plan)->cacheable = 0;
+  }
+
+  // builtins may modify their arguments, so only external commands are kept
+  if ((*plan)->cacheable && isExternalPlan(*plan)) {
+    if (entry->seenHash == hash) {
+      arenaReset(&entry->arena);
+      entry->plan = copyPlan(&entry->arena, *plan);
+      entry->hash = hash;
+      entry->length = length;
     }
+    entry->seenHash = hash;
   }
-    signal(SIGINT, allowProgramKill);
   return 0;
 }
 
 /*
-  Executes command with redirect
-  @param cmd: command to execute, including redirect & file
-  @param numArgs: number of arguments in command (including command itself)
-  @param redirectSym: either < or >
-  @param envp: environment variables
-  @return: 0 for success, non-zero otherwise
+  Replaces every word holding $(cmd) with the words cmd prints. Each cmd
+  is run as its own line with its stdout captured, and the word with the
+  output put in place of the $(...) is split at blanks and newlines.
+  @param arena: arena that will own the new words
+  @param cmd: [in/out] command from parseLine, replaced by the expanded one
+  @param numArgs: [in/out] number of args in cmd
+  @return: 0 for success, positive for a syntax error, negative for error
 */
-int execRedirectedCommand(char* cmd[], int numArgs, char redirectSym, char* envp[])
+int expandSubstitutions(struct arena* arena, char** cmd[], int* numArgs)
 {
-  int status;
-  int fd;
-  pid_t pid;
-  signal(SIGINT, preventProgramKill);	 
-  pid = fork();
-  if (pid < 0) {
-    fprintf(stderr, "\nError creating pipe. Error:%d\n", errno);
+  int maxArgs = *numArgs + 8;
+  char** expanded = arenaAlloc(arena, maxArgs * sizeof(char*));
+  if (!expanded) {
     return -1;
   }
+  int numExpanded = 0;
+  int i;
+  for (i = 0; i < *numArgs; ++i) {
+    char* word = (*cmd)[i];
+    char* dollar = strstr(word, "$(");
+    if (!dollar) {
+      if (numExpanded + 1 >= maxArgs) {
+        char** grown = arenaAlloc(arena, maxArgs * 2 * sizeof(char*));
+        if (!grown) {
+          return -1;
+        }
+        memcpy(grown, expanded, numExpanded * sizeof(char*));
+        expanded = grown;
+        maxArgs *= 2;
+      }
+      expanded[numExpanded++] = word;
+      continue;
+    }
 
-  if (pid == 0) {
-    // child process
-    // redirect input or output as needed
-    if (redirectSym == '<') {
-      fd = open(cmd[numArgs - 1], O_RDONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-      if (fd < 0) {
-        fprintf(stderr, "\nError opening %s. Error#%d\n", cmd[numArgs - 1], errno);
-        exit(EXIT_FAILURE);
+    // the word with each $(...) replaced by its command's output
+    struct substitution sub = { 0 };
+    char* p = word;
+    for (; dollar; dollar = strstr(p, "$(")) {
+      if (appendOutput(&sub, p, dollar - p) != 0) {
+        free(sub.out);
+        return -1;
       }
-      if (dup2(fd, STDIN_FILENO) < 0) {
-        fprintf(stderr, "\nError resetting stdin to %s. Error#%d\n", cmd[numArgs -1], errno);
-        exit(EXIT_FAILURE);
+      // the first ) that brings the depth back to 0 ends this one
+      char* inner = dollar + 2;
+      char* close = inner;
+      int depth = 1;
+      for (; *close != '\0'; ++close) {
+        depth += (*close == '(') - (*close == ')');
+        if (depth == 0) {
+          break;
+        }
       }
-    }
-    else {
-      fd = open(cmd[numArgs - 1], O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-      if (fd < 0) {
-        fprintf(stderr, "\nError opening %s. Error#%d\n", cmd[numArgs - 1], errno);
-        exit(EXIT_FAILURE);
+      if (depth > 0) {
+        free(sub.out);
+        return syntaxError("$(");
       }
-      if (dup2(fd, STDOUT_FILENO) < 0) {
-        fprintf(stderr, "\nError resetting stdout to %s. Error#%d\n", cmd[numArgs -1], errno);
-        exit(EXIT_FAILURE);
+      struct arena subArena = { 0 };
+      struct plan* plan;
+      char* line = arenaAlloc(&subArena, close - inner + 1);
+      int ret = -1;
+      if (line) {
+        memcpy(line, inner, close - inner);
+        line[close - inner] = '\0';
+        ret = compileLine(&subArena, line, close - inner, &plan);
       }
-    }
-    close(fd);
-    // copy command up to redirect
-    cmd = realloc(cmd, (numArgs - 1) * sizeof(char*));
-    cmd[numArgs - 2] = 0;
-
-    #ifdef __linux__
-    if (execvpe(cmd[0], cmd, envp) < 0) {
-    #endif
-    #ifdef __APPLE__
-    if (execvP(cmd[0], getenv("PATH"), cmd) < 0) {
-    #endif
-      if (errno == 2) {
-        fprintf(stderr, "\n%s not found.\n", cmd[0]);
+      if (ret == 0) {
+        sub.plan = plan;
+        runTaskPool(1, 0, startSubstitution, finishSubstitution, &sub);
       }
-      else {
-        fprintf(stderr, "\nError execing %s. Error#%d\n", cmd[0], errno);
+      arenaFree(&subArena);
+      if (ret < 0 || sub.failed) {
+        free(sub.out);
+        return -1;
       }
-      exit(EXIT_FAILURE);
+      p = close + 1;
     }
-    exit(0);
-  }
-  else {
-    // parent process
-    if (waitpid(pid, &status, 0) == -1) {
-      fprintf(stderr, "\nError in child process %d. Error#%d\n", pid, errno);
+    if (appendOutput(&sub, p, strlen(p)) != 0) {
+      free(sub.out);
       return -1;
     }
-    if (WIFEXITED(status)) {
-      if (WEXITSTATUS(status) == EXIT_FAILURE) {
-        return -1;
+
+    // split into words, copied out once so the capture can be freed
+    char* text = arenaAlloc(arena, sub.length + 1);
+    if (!text) {
+      free(sub.out);
+      return -1;
+    }
+    memcpy(text, sub.out, sub.length);
+    text[sub.length] = '\0';
+    free(sub.out);
+    char* end = text + sub.length;
+    while (1) {
+      while (text < end && (*text == ' ' || *text == '\t' || *text == '\n')) {
+        text++;
+      }
+      if (text >= end) {
+        break;
+      }
+      if (numExpanded + 1 >= maxArgs) {
+        char** grown = arenaAlloc(arena, maxArgs * 2 * sizeof(char*));
+        if (!grown) {
+          return -1;
+        }
+        memcpy(grown, expanded, numExpanded * sizeof(char*));
+        expanded = grown;
+        maxArgs *= 2;
       }
+      expanded[numExpanded++] = text;
+      text += strcspn(text, " \t\n");
+      *text++ = '\0';
     }
-      signal(SIGINT, allowProgramKill);
-    return 0;
   }
+  expanded[numExpanded] = 0;
+  *cmd = expanded;
+  *numArgs = numExpanded;
+  return (numExpanded == 0) ? 1 : 0;
 }
 
 /*
-  Executes command as background process
-  @param cmd: command to execute with arguments
-  @param envp: environment variables
-  @return: 0 for success, non-zero otherwise
+  Appends to the text a substitution is building
+  @param sub: substitution being expanded
+  @param data: text to add
+  @param length: length of data
+  @return: 0 for success, non-zero for allocation error
 */
-int execBackgroundCommand(char* cmd[], char* envp[])
+int appendOutput(struct substitution* sub, const char* data, size_t length)
 {
-  int status;
-  pid_t pid;
-
-  // create signal handler for child
-  struct sigaction act;
-  act.sa_sigaction = *exitChildHandler;
-  act.sa_flags = SA_SIGINFO | SA_RESTART;
-  if (sigaction(SIGCHLD, &act, NULL) < 0) {
-    fprintf(stderr, "Error in handling child signal: Error%d\n", errno);
+  if (length == 0) {
+    // nothing printed, out may still be NULL
+    return 0;
   }
-
-  // this will make sure parent sets up jobs even if child finishes before parent is called
-  sigprocmask(SIG_BLOCK, &mask, &oldMask);
-  pid = fork();
-  if (pid < 0) {
-    fprintf(stderr, "\nError forking child. Error:%d\n", errno);
-    exit(EXIT_FAILURE);
-  }
-  if (pid == 0) {
-    // child process
-    #ifdef __linux__
-    if (execvpe(cmd[0], cmd, envp) < 0) {
-    #endif
-    #ifdef __APPLE__
-    if (execvP(cmd[0], getenv("PATH"), cmd) < 0) {
-    #endif
-      if (errno == 2) {
-        fprintf(stderr, "\n%s not found.\n", cmd[0]);
-      }
-      else {
-        fprintf(stderr, "\nError execing %s. Error#%d\n", cmd[0], errno);
-      }
-      exit(EXIT_FAILURE);
+  if (sub->length + length > sub->size) {
+    // doubling keeps large captures linear in their size
+    size_t newSize = sub->size ? sub->size * 2 : 4096;
+    while (newSize < sub->length + length) {
+      newSize *= 2;
+    }
+    char* grown = quashRealloc(sub->out, newSize);
+    if (!grown) {
+      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+      return -1;
     }
-    exit(0);
+    sub->out = grown;
+    sub->size = newSize;
   }
-  else {
-    //create new job for job array with all job information
-    struct job newjob;
-    newjob.pid = pid; 
-    newjob.jobid = jobCount;
-    printf("[%d] %d running in background\n", jobCount, pid); 
-    newjob.bgcommand = (char*) malloc(100);
-    strcpy(newjob.bgcommand, cmd[0]);
-    newjob.finishedFlag = 0; 
-    jobArray[jobCount] = newjob;
-    jobCount++;
-    // since jobs have been set up, signals can now unblock
-    sigprocmask(SIG_UNBLOCK, &mask, &oldMask);
-    while (waitpid(pid, &status, WNOHANG) > 0) {} 
-    return 0;
-  } 
-  
+  memcpy(sub->out + sub->length, data, length);
+  sub->length += length;
+  return 0;
 }
-  
-/* 
-  @param: once background child ends, alert the rest of the program the child has exited. 
+
+/*
+  Starts the command of a substitution for runTaskPool with its stdout
+  going to outFd. A lone external command is spawned directly, anything
+  else runs in a forked copy of quash.
+  @param ctx: struct substitution being expanded
+  @param index: task number, there is only task 0
+  @param outFd: write end of the capture pipe
+  @param pid: [out] pid of the child
+  @return: 0 if started, 1 once it has been, negative for error
 */
-void exitChildHandler(int signal, siginfo_t* info, void* ctx)
+int startSubstitution(void* ctx, int index, int outFd, pid_t* pid)
 {
-  // find job associated with PID
-  pid_t pid = info->si_pid;
-  int status;
-  int i;
-  for (i = 0; i < jobCount; ++i) {
-    if (jobArray[i].pid == pid) {
-      break;
-    }
+  struct substitution* sub = ctx;
+  if (index > 0) {
+    return 1;
+  }
+  struct plan* plan = sub->plan;
+  struct stage* stage = &plan->stages[0];
+  if (plan->numStages == 1 && !plan->background && stage->numRedirects == 0
+      && !stage->placement && !isBuiltin(stage->argv[0])) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+    int ret = spawnCommand(stage->argv, &actions, pid);
+    posix_spawn_file_actions_destroy(&actions);
+    return ret;
+  }
+  fflush(stdout);
+  *pid = fork();
+  if (*pid < 0) {
+    fprintf(stderr, "\nError forking substitution. Error:%d\n", errno);
+    return -1;
   }
-  if (i < jobCount) {
-    // found background job that completed
-    printf("[%d] %d finished %s\n", jobArray[i].jobid, pid, jobArray[i].bgcommand); 
-    jobArray[i].finishedFlag = 1;
-    // free command name
-    free(jobArray[i].bgcommand);
+  if (*pid == 0) {
+    dup2(outFd, STDOUT_FILENO);
+    closeUnusedCoprocs(plan);
+    int ret = execCommand(plan);
+    fflush(stdout);
+    _exit(ret & 0xff);
   }
+  return 0;
 }
 
-/* 
-  Changes directory
-  @param args: command from commandline
-  @return: 0 if successful
-
-  Note: if cd is called with no additional
-  args, will go to home
+/*
+  Adds the captured output of a substitution's command to its text. The
+  trailing newlines are dropped.
+  @param ctx: struct substitution being expanded
+  @param index: task number
+  @param status: exit status of the command
+  @param out: what it printed
+  @param length: length of out
 */
-int cd(char* args[]) 
+void finishSubstitution(void* ctx, int index, int status, char* out, size_t length)
 {
-  if (args[1] == '\0') {
-    char* home = getenv("HOME");
-	  chdir(home); 
-  } 
-  else { 
-	  if (chdir(args[1])!= 0) {
-    	  	printf("cd: %s: No such file or directory\n", args[1]); 
-	  }
-    return 1;
-  } 
-  return 0;
+  // a failed command still substitutes whatever it printed
+  (void) index;
+  (void) status;
+  struct substitution* sub = ctx;
+  while (length > 0 && out[length - 1] == '\n') {
+    length--;
+  }
+  if (appendOutput(sub, out, length) != 0) {
+    sub->failed = 1;
+  }
 }
 
-//scroll through jobs, looking for all commands still active
-int jobs() 
+/*
+  Replaces every word holding *, ? or [...] with the paths it matches,
+  sorted. A pattern matching nothing is left as it is. Directories are
+  read once per command however many patterns look in them.
+  @param arena: arena that will own the new words
+  @param cmd: [in/out] command from parseLine, replaced by the expanded one
+  @param numArgs: [in/out] number of args in cmd
+  @return: 0 for success, negative for error
+*/
+int expandGlobs(struct arena* arena, char** cmd[], int* numArgs)
 {
+  struct globRun run = { .arena = arena };
+  int maxArgs = *numArgs + 8;
+  char** expanded = arenaAlloc(arena, maxArgs * sizeof(char*));
+  if (!expanded) {
+    return -1;
+  }
+  int numExpanded = 0;
+  int ret = 0;
   int i;
-  for (i = 0; i < jobCount; i++) {
-    if(jobArray[i].finishedFlag == 0) {
-		  printf("[%d] %d %s \n", jobArray[i].jobid, jobArray[i].pid, jobArray[i].bgcommand); 
+  for (i = 0; i < *numArgs && ret == 0; ++i) {
+    char* word = (*cmd)[i];
+    run.numMatches = 0;
+    if (word != metaTokens[(unsigned char) word[0]] && hasGlobChars(word, strlen(word))) {
+      char path[PATH_MAX];
+      ret = globPath(&run, path, 0, word, 0);
+      qsort(run.matches, run.numMatches, sizeof(char*), compareStrings);
     }
-	}
+    int numWords = run.numMatches ? run.numMatches : 1;
+    if (numExpanded + numWords >= maxArgs) {
+      while (numExpanded + numWords >= maxArgs) {
+        maxArgs *= 2;
+      }
+      char** grown = arenaAlloc(arena, maxArgs * sizeof(char*));
+      if (!grown) {
+        ret = -1;
+        break;
+      }
+      memcpy(grown, expanded, numExpanded * sizeof(char*));
+      expanded = grown;
+    }
+    if (run.numMatches) {
+      memcpy(expanded + numExpanded, run.matches, run.numMatches * sizeof(char*));
+    }
+    else {
+      expanded[numExpanded] = word;
+    }
+    numExpanded += numWords;
+  }
+  expanded[numExpanded] = 0;
+  freeGlobRun(&run);
+  if (ret != 0) {
+    return ret;
+  }
+  *cmd = expanded;
+  *numArgs = numExpanded;
   return 0;
 }
 
 /*
-  Prints or sets PATH & HOME variables
-  @param args: command from commandline
-  @return: 0 if successful
+  Checks a piece of a word for glob characters. A [ only counts with a ]
+  after it, so words like [ stay literal without reading any directory.
+  @param p: start of the text
+  @param length: length of the text
+  @return: 1 if it holds a pattern, 0 otherwise
+*/
+int hasGlobChars(const char* p, size_t length)
+{
+  const char* end = p + length;
+  for (; p < end; ++p) {
+    if (*p == '*' || *p == '?' || (*p == '[' && memchr(p + 1, ']', end - p - 1))) {
+      return 1;
+    }
+  }
+  return 0;
+}
 
-  Note: if set is called with no additional
-  args, path and home will be printed
+/*
+  Matches the rest of a pattern one path component at a time, reading
+  each directory a component with glob characters has to look in
+  @param run: expansion of the current command
+  @param path: buffer of PATH_MAX holding the path matched so far
+  @param length: length of path, ending in / unless 0
+  @param pattern: rest of the pattern, from the start of a component
+  @param globbed: whether a component with glob characters was matched yet
+  @return: 0 for success, negative for allocation error
 */
-int set(char* args[])
+int globPath(struct globRun* run, char* path, size_t length, const char* pattern, int globbed)
 {
-  if (args[1] == NULL) {
-    // print home & path environment variables
-    char* path = getenv("PATH");
-    char* home = getenv("HOME");
-    printf("PATH:%s\n", path);
-    printf("HOME:%s\n", home);
+  const char* slash = strchr(pattern, '/');
+  size_t componentLength = slash ? (size_t) (slash - pattern) : strlen(pattern);
+  if (!hasGlobChars(pattern, componentLength)) {
+    // a literal component is just added, only the final path has to exist
+    size_t addLength = componentLength + (slash != NULL);
+    if (length + addLength >= PATH_MAX) {
+      return 0;
+    }
+    memcpy(path + length, pattern, addLength);
+    path[length + addLength] = '\0';
+    if (slash) {
+      return globPath(run, path, length + addLength, slash + 1, globbed);
+    }
+    struct stat st;
+    if (!globbed || lstat(path, &st) != 0) {
+      return 0;
+    }
+    return addGlobMatch(run, path);
   }
-  else {
-    // figure out whether setting path or home
-    char* variable = strtok(args[1], "=");
-    if (variable == NULL) {
-      fprintf(stderr, "Usage: set <envVariable>=<newValue>\n");
-      return 1;
+
+  char component[NAME_MAX + 1];
+  if (componentLength > NAME_MAX) {
+    return 0;
+  }
+  memcpy(component, pattern, componentLength);
+  component[componentLength] = '\0';
+  path[length] = '\0';
+  struct dirListing* listing = readDirListing(run, length ? path : ".");
+  if (!listing) {
+    // unreadable or not a directory, nothing in it matches
+    return 0;
+  }
+  int i;
+  for (i = 0; i < listing->count; ++i) {
+    const char* name = listing->names + listing->entries[i].offset;
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+      continue;
     }
-    else if (strcmp(variable, "PATH") == 0) {
-      char* newPath = strtok(NULL, "=");
-      if (newPath == NULL) {
-        fprintf(stderr, "Usage: set <envVariable>=<newValue>\n");
-        return 1;
-      }
-      setenv(variable, newPath, 1);
+    // FNM_PERIOD keeps * and ? from matching hidden files
+    if (fnmatch(component, name, FNM_PERIOD) != 0) {
+      continue;
     }
-    else if (strcmp(variable, "HOME") == 0) {
-      char* newHome = strtok(NULL, "=");
-      if (newHome == NULL) {
-                fprintf(stderr, "Usage: set <envVariable>=<newValue>\n");
-        return 1;
+    size_t nameLength = strlen(name);
+    if (length + nameLength + 1 >= PATH_MAX) {
+      continue;
+    }
+    memcpy(path + length, name, nameLength + 1);
+    if (!slash) {
+      if (addGlobMatch(run, path) != 0) {
+        return -1;
       }
-      setenv(variable, newHome, 1);
+      continue;
     }
-    else {
-      fprintf(stderr, "set can be used for PATH or HOME\n");
-      return 1;
+    // only directories can match the rest, links & unknown types are checked
+    unsigned char type = listing->entries[i].type;
+    struct stat st;
+    if (type != DT_DIR
+        && ((type != DT_LNK && type != DT_UNKNOWN) || stat(path, &st) != 0 || !S_ISDIR(st.st_mode))) {
+      continue;
+    }
+    path[length + nameLength] = '/';
+    path[length + nameLength + 1] = '\0';
+    if (globPath(run, path, length + nameLength + 1, slash + 1, 1) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+  Adds a path to the matches of the word being expanded
+  @param run: expansion of the current command
+  @param path: matching path, copied into the command's arena
+  @return: 0 for success, negative for allocation error
+*/
+int addGlobMatch(struct globRun* run, const char* path)
+{
+  if (run->numMatches == run->size) {
+    int newSize = run->size ? run->size * 2 : 64;
+    char** grown = quashRealloc(run->matches, newSize * sizeof(char*));
+    if (!grown) {
+      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+      return -1;
+    }
+    run->matches = grown;
+    run->size = newSize;
+  }
+  if (!(run->matches[run->numMatches] = arenaStrdup(run->arena, path))) {
+    return -1;
+  }
+  run->numMatches++;
+  return 0;
+}
+
+/*
+  Gets the names in a directory, reading it only the first time it is
+  asked for during a command. On linux entries come from getdents64 a
+  large batch at a time rather than one readdir call each.
+  @param run: expansion of the current command, owning the cache
+  @param dirPath: directory to list
+  @return: its listing, NULL if it could not be read
+*/
+struct dirListing* readDirListing(struct globRun* run, const char* dirPath)
+{
+  unsigned long hash = hashString(dirPath);
+  struct dirListing** link = &run->listings[hash & (GLOB_CACHE_SIZE - 1)];
+  for (; *link != NULL; link = &(*link)->next) {
+    if ((*link)->hash == hash && strcmp((*link)->path, dirPath) == 0) {
+      return (*link)->count >= 0 ? *link : NULL;
+    }
+  }
+  struct dirListing* listing = quashMalloc(sizeof(struct dirListing));
+  if (!listing) {
+    fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+    return NULL;
+  }
+  memset(listing, 0, sizeof(struct dirListing));
+  listing->path = quashStrdup(dirPath);
+  listing->hash = hash;
+  // a directory that can't be read is remembered too, as an empty one
+  listing->count = -1;
+  listing->next = NULL;
+  *link = listing;
+  if (!listing->path) {
+    return NULL;
+  }
+
+#ifdef __linux__
+  int fd = open(dirPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (!run->batch && !(run->batch = quashMalloc(GLOB_BATCH_SIZE))) {
+    fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+    close(fd);
+    return NULL;
+  }
+  listing->count = 0;
+  long numRead;
+  while ((numRead = syscall(SYS_getdents64, fd, run->batch, GLOB_BATCH_SIZE)) > 0) {
+    long offset = 0;
+    while (offset < numRead) {
+      struct linuxDirent64* dirent = (struct linuxDirent64*) (run->batch + offset);
+      if (addDirEntry(listing, dirent->d_name, dirent->d_type) != 0) {
+        close(fd);
+        return NULL;
+      }
+      offset += dirent->d_reclen;
+    }
+  }
+  close(fd);
+#else
+  DIR* dir = opendir(dirPath);
+  if (!dir) {
+    return NULL;
+  }
+  listing->count = 0;
+  struct dirent* dirent;
+  while ((dirent = readdir(dir)) != NULL) {
+    if (addDirEntry(listing, dirent->d_name, dirent->d_type) != 0) {
+      closedir(dir);
+      return NULL;
+    }
+  }
+  closedir(dir);
+#endif
+  return listing;
+}
+
+/*
+  Adds a name to a directory listing
+  @param listing: listing being read
+  @param name: name of the entry
+  @param type: DT_ type of the entry
+  @return: 0 for success, negative for allocation error
+*/
+int addDirEntry(struct dirListing* listing, const char* name, unsigned char type)
+{
+  size_t nameLength = strlen(name) + 1;
+  if (listing->namesLength + nameLength > listing->namesSize) {
+    size_t newSize = listing->namesSize ? listing->namesSize * 2 : 4096;
+    while (newSize < listing->namesLength + nameLength) {
+      newSize *= 2;
+    }
+    char* grown = quashRealloc(listing->names, newSize);
+    if (!grown) {
+      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+      listing->count = -1;
+      return -1;
+    }
+    listing->names = grown;
+    listing->namesSize = newSize;
+  }
+  if (listing->count == listing->size) {
+    int newSize = listing->size ? listing->size * 2 : 64;
+    struct dirEntryName* grown = quashRealloc(listing->entries, newSize * sizeof(struct dirEntryName));
+    if (!grown) {
+      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+      listing->count = -1;
+      return -1;
+    }
+    listing->entries = grown;
+    listing->size = newSize;
+  }
+  // names are kept by offset, the buffer moves as it grows
+  memcpy(listing->names + listing->namesLength, name, nameLength);
+  listing->entries[listing->count].offset = listing->namesLength;
+  listing->entries[listing->count].type = type;
+  listing->count++;
+  listing->namesLength += nameLength;
+  return 0;
+}
+
+/*
+  Frees the directory cache and match list of a command's expansion
+  @param run: expansion that is done
+*/
+void freeGlobRun(struct globRun* run)
+{
+  int i;
+  for (i = 0; i < GLOB_CACHE_SIZE; ++i) {
+    struct dirListing* listing = run->listings[i];
+    while (listing) {
+      struct dirListing* next = listing->next;
+      free(listing->path);
+      free(listing->names);
+      free(listing->entries);
+      free(listing);
+      listing = next;
+    }
+  }
+  free(run->matches);
+  free(run->batch);
+}
+
+/*
+  Orders strings for qsort
+*/
+int compareStrings(const void* a, const void* b)
+{
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/*
+  Builds an execution plan from a tokenized command in a single pass:
+  the command is cut into pipeline stages at each |, < and > with their
+  file become fd actions of the stage they appear in, and a final & makes
+  the whole pipeline a background job. Words are not copied, each stage's
+  argv points at the same strings as cmd.
+  @param arena: arena that will own the plan
+  @param cmd: command from parseLine
+  @param numArgs: number of args in cmd
+  @param text: command line as typed, shown for background jobs
+  @param plan: [out] compiled plan
+  @return: 0 for success, positive for a syntax error, negative for
+    allocation error
+*/
+int compilePlan(struct arena* arena, char* cmd[], int numArgs, char* text, struct plan** plan)
+{
+  int numStages = 1;
+  int numRedirects = 0;
+  int i;
+  for (i = 0; i < numArgs; ++i) {
+    if (cmd[i] == metaTokens['|']) {
+      numStages++;
+    }
+    else if (cmd[i] == metaTokens['<'] || cmd[i] == metaTokens['>']) {
+      numRedirects++;
+    }
+  }
+
+  *plan = arenaAlloc(arena, sizeof(struct plan));
+  // every stage's argv is a slice of words ending in its own NULL
+  char** words = arenaAlloc(arena, (numArgs + numStages) * sizeof(char*));
+  struct stage* stages = arenaAlloc(arena, numStages * sizeof(struct stage));
+  struct redirect* redirects = arenaAlloc(arena, (numRedirects + 1) * sizeof(struct redirect));
+  if (!(*plan) || !words || !stages || !redirects) {
+    return -1;
+  }
+  (*plan)->stages = stages;
+  (*plan)->numStages = numStages;
+  (*plan)->background = 0;
+  (*plan)->cacheable = 1;
+  (*plan)->timed = 0;
+  (*plan)->schedClass = NULL;
+  (*plan)->numHereDocs = 0;
+  (*plan)->numBodyLines = 0;
+  (*plan)->text = text;
+
+  struct stage* stage = stages;
+  stage->argv = words;
+  stage->redirects = redirects;
+  stage->numRedirects = 0;
+  stage->placement = NULL;
+  i = 0;
+  if (strcmp(cmd[0], "time") == 0) {
+    // time prefixes the whole pipeline rather than running as a command
+    (*plan)->timed = 1;
+    i = 1;
+  }
+  if (i + 2 < numArgs && strcmp(cmd[i], "bg-class") == 0 && !isJobIdList(cmd + i + 2, numArgs - i - 2)
+      && charClass[(unsigned char) cmd[i + 2][0]] != CHAR_META) {
+    // bg-class CLASS cmd starts the whole pipeline in that class,
+    // bg-class CLASS ID is the builtin that changes running jobs
+    (*plan)->schedClass = arenaAlloc(arena, sizeof(struct schedClass));
+    if (!(*plan)->schedClass) {
+      return -1;
+    }
+    if (parseSchedClass(cmd[i + 1], (*plan)->schedClass) != 0) {
+      fprintf(stderr, "bg-class: unknown class '%s'\n", cmd[i + 1]);
+      return 2;
+    }
+    i += 2;
+  }
+  for (; i < numArgs; ++i) {
+    char* arg = cmd[i];
+    if (arg == metaTokens['|']) {
+      if (words == stage->argv) {
+        return syntaxError(arg);
+      }
+      // end this stage, next one starts after it
+      *words++ = 0;
+      stage++;
+      stage->argv = words;
+      stage->redirects = redirects;
+      stage->numRedirects = 0;
+      stage->placement = NULL;
+    }
+    else if (arg == metaTokens['<'] || arg == metaTokens['>']) {
+      redirects->kind = REDIRECT_FILE;
+      if (i + 1 < numArgs && cmd[i + 1] == metaTokens['&']) {
+        // <&NAME & >&NAME read from & write to a coproc
+        redirects->kind = REDIRECT_COPROC;
+        i++;
+      }
+      else if (arg == metaTokens['<'] && i + 1 < numArgs && cmd[i + 1] == metaTokens['<']) {
+        // <<WORD is a here-document ended by WORD, <<<word a here-string
+        redirects->kind = REDIRECT_HERE_DOC;
+        i++;
+        if (i + 1 < numArgs && cmd[i + 1] == metaTokens['<']) {
+          redirects->kind = REDIRECT_HERE;
+          i++;
+        }
+      }
+      if (i + 1 >= numArgs || charClass[(unsigned char) cmd[i + 1][0]] == CHAR_META) {
+        return syntaxError(i + 1 < numArgs ? cmd[i + 1] : "newline");
+      }
+      redirects->path = cmd[++i];
+      if (redirects->kind == REDIRECT_HERE_DOC) {
+        // the body is read after the line, and differs each time
+        (*plan)->numHereDocs++;
+        (*plan)->cacheable = 0;
+      }
+      else if (redirects->kind == REDIRECT_HERE) {
+        size_t length = strlen(redirects->path);
+        char* here = arenaAlloc(arena, length + 2);
+        if (!here) {
+          return -1;
+        }
+        memcpy(here, redirects->path, length);
+        here[length] = '\n';
+        here[length + 1] = '\0';
+        redirects->path = here;
+      }
+      if (arg == metaTokens['<']) {
+        redirects->fd = STDIN_FILENO;
+        redirects->flags = O_RDONLY;
+      }
+      else {
+        redirects->fd = STDOUT_FILENO;
+        redirects->flags = O_WRONLY | O_TRUNC | O_CREAT;
+      }
+      redirects++;
+      stage->numRedirects++;
+    }
+    else if (arg == metaTokens['&']) {
+      if (i != numArgs - 1) {
+        return syntaxError(cmd[i + 1]);
+      }
+      (*plan)->background = 1;
+    }
+    else if (words == stage->argv && !stage->placement && strcmp(arg, "pin") == 0) {
+      // pin prefixes a single stage
+      int ret = parsePlacement(arena, cmd, numArgs, &i, stage);
+      if (ret != 0) {
+        return ret;
+      }
+    }
+    else {
+      *words++ = arg;
+    }
+  }
+  if (words == stage->argv) {
+    // nothing to run in the last stage
+    return syntaxError(numStages > 1 ? "|" : "newline");
+  }
+  *words = 0;
+  return 0;
+}
+
+/*
+  Parses the pin prefix of a stage:
+    pin [-m NODELIST | -i NODELIST] CPULIST cmd ...
+  CPULIST restricts the stage to those cpus, -m binds its memory to those
+  NUMA nodes and -i interleaves its memory across them.
+  @param arena: arena that will own the placement
+  @param cmd: command from parseLine
+  @param numArgs: number of args in cmd
+  @param i: [in/out] index of "pin", left on the last word of the prefix
+  @param stage: stage the prefix applies to
+  @return: 0 for success, positive for a syntax error, negative for
+    allocation error
+*/
+int parsePlacement(struct arena* arena, char* cmd[], int numArgs, int* i, struct stage* stage)
+{
+#ifdef __linux__
+  struct placement* placement = arenaAlloc(arena, sizeof(struct placement));
+  if (!placement) {
+    return -1;
+  }
+  placement->memPolicy = MPOL_DEFAULT;
+  placement->nodes = 0;
+  int n = *i + 1;
+  if (n + 1 < numArgs && (strcmp(cmd[n], "-m") == 0 || strcmp(cmd[n], "-i") == 0)) {
+    placement->memPolicy = (cmd[n][1] == 'm') ? MPOL_BIND : MPOL_INTERLEAVE;
+    cpu_set_t nodes;
+    if (parseIdList(cmd[n + 1], &nodes) != 0) {
+      fprintf(stderr, "pin: bad node list '%s'\n", cmd[n + 1]);
+      return 2;
+    }
+    int node = 0;
+    for (; node < (int) (8 * sizeof(placement->nodes)); ++node) {
+      if (CPU_ISSET(node, &nodes)) {
+        placement->nodes |= 1UL << node;
+      }
+    }
+    if (placement->nodes == 0) {
+      fprintf(stderr, "pin: bad node list '%s'\n", cmd[n + 1]);
+      return 2;
+    }
+    n += 2;
+  }
+  if (n >= numArgs || charClass[(unsigned char) cmd[n][0]] == CHAR_META) {
+    return syntaxError(n < numArgs ? cmd[n] : "newline");
+  }
+  if (parseIdList(cmd[n], &placement->cpus) != 0) {
+    fprintf(stderr, "pin: bad cpu list '%s'\n", cmd[n]);
+    return 2;
+  }
+  stage->placement = placement;
+  *i = n;
+  return 0;
+#else
+  fprintf(stderr, "pin: not supported on this system\n");
+  return 2;
+#endif
+}
+
+#ifdef __linux__
+/*
+  Parses a list of ids such as 0-3,8,10-11
+  @param text: list to parse
+  @param ids: [out] set of the ids in the list
+  @return: 0 for success, non-zero if text is not a valid list
+*/
+int parseIdList(const char* text, cpu_set_t* ids)
+{
+  CPU_ZERO(ids);
+  const char* p = text;
+  while (1) {
+    char* end;
+    long first = strtol(p, &end, 10);
+    if (end == p || first < 0) {
+      return -1;
+    }
+    long last = first;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first) {
+        return -1;
+      }
+    }
+    if (last >= CPU_SETSIZE) {
+      return -1;
+    }
+    for (; first <= last; ++first) {
+      CPU_SET(first, ids);
+    }
+    if (*end == '\0') {
+      return 0;
+    }
+    if (*end != ',') {
+      return -1;
+    }
+    p = end + 1;
+  }
+}
+
+/*
+  Moves quash onto a stage's cpus and memory policy just before it is
+  spawned. posix_spawn has no attribute for either, but the child
+  inherits both from the thread that spawns it and keeps them across exec.
+  @param placement: where the stage should run
+  @return: 0 for success, non-zero if it could not be applied
+*/
+int applyPlacement(struct placement* placement)
+{
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &placement->savedCpus) < 0) {
+    fprintf(stderr, "\npin: could not get cpu affinity. Error#%d\n", errno);
+    return -1;
+  }
+  placement->savedPolicy = MPOL_DEFAULT;
+  placement->savedNodes = 0;
+  if (placement->memPolicy != MPOL_DEFAULT
+      && syscall(SYS_get_mempolicy, &placement->savedPolicy, &placement->savedNodes, 8 * sizeof(placement->savedNodes) + 1, NULL, 0) < 0) {
+    fprintf(stderr, "\npin: could not get memory policy. Error#%d\n", errno);
+    return -1;
+  }
+  if (sched_setaffinity(0, sizeof(cpu_set_t), &placement->cpus) < 0) {
+    fprintf(stderr, "\npin: could not set cpu affinity. Error#%d\n", errno);
+    return -1;
+  }
+  if (placement->memPolicy != MPOL_DEFAULT
+      && syscall(SYS_set_mempolicy, placement->memPolicy, &placement->nodes, 8 * sizeof(placement->nodes) + 1) < 0) {
+    fprintf(stderr, "\npin: could not set memory policy. Error#%d\n", errno);
+    restorePlacement(placement);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+  Puts quash back on the cpus and memory policy it had before applyPlacement
+  @param placement: placement applied by applyPlacement
+*/
+void restorePlacement(struct placement* placement)
+{
+  sched_setaffinity(0, sizeof(cpu_set_t), &placement->savedCpus);
+  if (placement->memPolicy != MPOL_DEFAULT) {
+    unsigned long* nodes = placement->savedPolicy == MPOL_DEFAULT ? NULL : &placement->savedNodes;
+    syscall(SYS_set_mempolicy, placement->savedPolicy, nodes, nodes ? 8 * sizeof(placement->savedNodes) + 1 : 0);
+  }
+}
+#endif
+
+/*
+  Parses a scheduling class for bg-class: one of the presets
+    normal  nice 0, no io class, SCHED_OTHER
+    batch   nice 10, best effort io at the lowest level, SCHED_BATCH
+    idle    nice 19, idle io, SCHED_IDLE
+  or a comma separated list of nice=N, io=idle|be[:LEVEL]|rt[:LEVEL] and
+  sched=other|batch|idle, unset parts staying as in normal
+  @param text: class to parse
+  @param schedClass: [out] parsed class
+  @return: 0 for success, non-zero if text is not a class
+*/
+int parseSchedClass(const char* text, struct schedClass* schedClass)
+{
+  memset(schedClass, 0, sizeof(struct schedClass));
+  snprintf(schedClass->name, sizeof(schedClass->name), "%s", text);
+  if (strcmp(text, "normal") == 0) {
+    return 0;
+  }
+  if (strcmp(text, "batch") == 0) {
+    schedClass->nice = 10;
+    schedClass->ioPriority = IOPRIO_VALUE(IOPRIO_CLASS_BE, 7);
+    schedClass->policy = SCHED_BATCH;
+    return 0;
+  }
+  if (strcmp(text, "idle") == 0) {
+    schedClass->nice = 19;
+    schedClass->ioPriority = IOPRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+    schedClass->policy = SCHED_IDLE;
+    return 0;
+  }
+  const char* p = text;
+  while (*p != '\0') {
+    size_t length = strcspn(p, ",");
+    char* end;
+    if (strncmp(p, "nice=", 5) == 0) {
+      long nice = strtol(p + 5, &end, 10);
+      if (end != p + length || end == p + 5 || nice < -20 || nice > 19) {
+        return -1;
+      }
+      schedClass->nice = nice;
+    }
+    else if (strncmp(p, "io=", 3) == 0) {
+      const char* io = p + 3;
+      int ioClass;
+      if (strncmp(io, "idle", 4) == 0) {
+        ioClass = IOPRIO_CLASS_IDLE;
+        io += 4;
+      }
+      else if (strncmp(io, "be", 2) == 0) {
+        ioClass = IOPRIO_CLASS_BE;
+        io += 2;
+      }
+      else if (strncmp(io, "rt", 2) == 0) {
+        ioClass = IOPRIO_CLASS_RT;
+        io += 2;
+      }
+      else {
+        return -1;
+      }
+      long level = (ioClass == IOPRIO_CLASS_IDLE) ? 0 : 4;
+      if (*io == ':') {
+        level = strtol(io + 1, &end, 10);
+        if (end == io + 1 || level < 0 || level > 7) {
+          return -1;
+        }
+        io = end;
+      }
+      if (io != p + length) {
+        return -1;
+      }
+      schedClass->ioPriority = IOPRIO_VALUE(ioClass, level);
+    }
+    else if (strncmp(p, "sched=", 6) == 0) {
+      const char* policy = p + 6;
+      size_t policyLength = length - 6;
+      if (policyLength == 5 && strncmp(policy, "other", 5) == 0) {
+        schedClass->policy = SCHED_OTHER;
+      }
+      else if (policyLength == 5 && strncmp(policy, "batch", 5) == 0) {
+        schedClass->policy = SCHED_BATCH;
+      }
+      else if (policyLength == 4 && strncmp(policy, "idle", 4) == 0) {
+        schedClass->policy = SCHED_IDLE;
+      }
+      else {
+        return -1;
+      }
+    }
+    else {
+      return -1;
+    }
+    p += length;
+    if (*p == ',') {
+      p++;
+    }
+  }
+  return 0;
+}
+
+/*
+  Checks whether every word is a job id, N or %N
+  @param words: words to check
+  @param numWords: number of words
+  @return: 1 if they all are, 0 otherwise
+*/
+int isJobIdList(char* words[], int numWords)
+{
+  int i = 0;
+  for (; i < numWords; ++i) {
+    char* id = words[i] + (words[i][0] == '%');
+    if (*id == '\0' || strspn(id, "0123456789") != strlen(id)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+  Gives a process a scheduling class: its scheduler policy, nice value
+  and io priority
+  @param pid: process to change
+  @param schedClass: class to give it
+  @return: 0 for success, non-zero if any part could not be set
+*/
+int applySchedClass(pid_t pid, struct schedClass* schedClass)
+{
+  int ret = 0;
+  struct sched_param param = { 0 };
+  if (sched_setscheduler(pid, schedClass->policy, &param) < 0) {
+    ret = errno;
+  }
+  // setting the policy resets nothing else, so nice is set after it
+  if (setpriority(PRIO_PROCESS, pid, schedClass->nice) < 0) {
+    ret = errno;
+  }
+#ifdef SYS_ioprio_set
+  if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, schedClass->ioPriority) < 0) {
+    ret = errno;
+  }
+#endif
+  if (ret != 0) {
+    fprintf(stderr, "\nbg-class: could not set %s for %d. Error#%d\n", schedClass->name, pid, ret);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+  Starts a command already in a scheduling class, so it never runs in the
+  normal class, not even before exec. The scheduler policy, nice and io
+  priority all belong to each thread and are inherited by its children,
+  so they are set on a short lived thread that does the spawn: quash's
+  own thread could not get its priority back once lowered, and glibc's
+  POSIX_SPAWN_SETSCHEDULER leaves the policy alone.
+  @param cmd: command vector to execute, NULL terminated
+  @param actions: dup2/open/close actions to apply in the child
+  @param pid: [out] pid of the new child
+  @param schedClass: class to start it in
+  @return: 0 for success, non-zero if the class could not be set or the
+    command could not be started
+*/
+int spawnInSchedClass(char* cmd[], posix_spawn_file_actions_t* actions, pid_t* pid,
+                      struct schedClass* schedClass)
+{
+  struct classSpawn spawn = { cmd, actions, pid, schedClass, -1 };
+  pthread_t thread;
+  int err = pthread_create(&thread, NULL, classSpawnThread, &spawn);
+  if (err != 0) {
+    fprintf(stderr, "\nError creating spawn thread. Error:%d\n", err);
+    return -1;
+  }
+  pthread_join(thread, NULL);
+  return spawn.ret;
+}
+
+/*
+  Thread started by spawnInSchedClass, quash's own thread waits for it
+  so nothing else touches quash's state meanwhile
+  @param arg: struct classSpawn to do, its ret is set
+  @return: NULL
+*/
+void* classSpawnThread(void* arg)
+{
+  struct classSpawn* spawn = arg;
+  struct schedClass* schedClass = spawn->schedClass;
+  pid_t tid = syscall(SYS_gettid);
+  int err = 0;
+  struct sched_param param = { 0 };
+  if (sched_setscheduler(0, schedClass->policy, &param) < 0) {
+    err = errno;
+  }
+  // setting the policy resets nothing else, so nice is set after it
+  if (setpriority(PRIO_PROCESS, tid, schedClass->nice) < 0) {
+    err = errno;
+  }
+#ifdef SYS_ioprio_set
+  if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, schedClass->ioPriority) < 0) {
+    err = errno;
+  }
+#endif
+  if (err != 0) {
+    fprintf(stderr, "\nbg-class: could not set %s for %s. Error#%d\n", schedClass->name, spawn->cmd[0], err);
+    return NULL;
+  }
+  spawn->ret = spawnCommand(spawn->cmd, spawn->actions, spawn->pid);
+  return NULL;
+}
+
+/*
+  Reports a syntax error in a command
+  @param token: token the error was found at
+  @return: 2, the line is skipped like a blank one
+*/
+int syntaxError(const char* token)
+{
+  fprintf(stderr, "syntax error near unexpected token '%s'\n", token);
+  return 2;
+}
+
+/*
+  Deep copies a plan, along with every string it uses, into an arena
+  @param arena: arena that will own the copy
+  @param plan: plan to copy
+  @return: the copy, NULL for allocation error
+*/
+struct plan* copyPlan(struct arena* arena, struct plan* plan)
+{
+  struct plan* copy = arenaAlloc(arena, sizeof(struct plan));
+  if (!copy) {
+    return NULL;
+  }
+  *copy = *plan;
+  if (plan->schedClass) {
+    copy->schedClass = arenaAlloc(arena, sizeof(struct schedClass));
+    if (!copy->schedClass) {
+      return NULL;
+    }
+    *copy->schedClass = *plan->schedClass;
+  }
+  copy->text = arenaStrdup(arena, plan->text);
+  copy->stages = arenaAlloc(arena, plan->numStages * sizeof(struct stage));
+  if (!copy->text || !copy->stages) {
+    return NULL;
+  }
+  int i;
+  for (i = 0; i < plan->numStages; ++i) {
+    struct stage* from = &plan->stages[i];
+    struct stage* to = &copy->stages[i];
+    int numWords = 0;
+    while (from->argv[numWords] != 0) {
+      numWords++;
+    }
+    to->argv = arenaAlloc(arena, (numWords + 1) * sizeof(char*));
+    to->redirects = arenaAlloc(arena, (from->numRedirects + 1) * sizeof(struct redirect));
+    to->numRedirects = from->numRedirects;
+    to->placement = NULL;
+    if (from->placement) {
+      to->placement = arenaAlloc(arena, sizeof(struct placement));
+      if (!to->placement) {
+        return NULL;
+      }
+      *to->placement = *from->placement;
+    }
+    if (!to->argv || !to->redirects) {
+      return NULL;
+    }
+    int j;
+    for (j = 0; j < numWords; ++j) {
+      if (!(to->argv[j] = arenaStrdup(arena, from->argv[j]))) {
+        return NULL;
+      }
+    }
+    to->argv[numWords] = 0;
+    for (j = 0; j < from->numRedirects; ++j) {
+      to->redirects[j] = from->redirects[j];
+      if (!(to->redirects[j].path = arenaStrdup(arena, from->redirects[j].path))) {
+        return NULL;
+      }
+    }
+  }
+  return copy;
+}
+
+/*
+  Finds a builtin by name. Builtins are told apart by length and first
+  character before a single strcmp confirms the match, so looking up an
+  external command costs at most one comparison.
+  @param name: command name
+  @return: the builtin, NULL if name is not one
+*/
+const struct builtin* findBuiltin(const char* name)
+{
+  int which = -1;
+  switch (strlen(name)) {
+    case 2:
+      which = (name[0] == 'c') ? BUILTIN_CD : BUILTIN_FG;
+      break;
+    case 3:
+      which = BUILTIN_SET;
+      break;
+    case 4:
+      switch (name[0]) {
+        case 'e': which = BUILTIN_EXIT; break;
+        case 'q': which = BUILTIN_QUIT; break;
+        case 'j': which = BUILTIN_JOBS; break;
+        case 'k': which = BUILTIN_KILL; break;
+        case 'h': which = BUILTIN_HASH; break;
+        case 'w': which = BUILTIN_WAIT; break;
+      }
+      break;
+    case 5:
+      which = BUILTIN_STATS;
+      break;
+    case 6:
+      which = (name[0] == 'e') ? BUILTIN_EXPORT : BUILTIN_COPROC;
+      break;
+    case 8:
+      which = (name[0] == 'b') ? BUILTIN_BG_CLASS : BUILTIN_PARALLEL;
+      break;
+  }
+  if (which < 0 || strcmp(builtins[which].name, name) != 0) {
+    return NULL;
+  }
+  return &builtins[which];
+}
+
+/*
+  Checks whether a command name is one of quash's builtins
+  @param name: command name
+  @return: 1 if it is a builtin, 0 otherwise
+*/
+int isBuiltin(const char* name)
+{
+  return findBuiltin(name) != NULL;
+}
+
+/*
+  Runs a compiled plan: any mix of pipes, redirects and & in one executor
+  @param plan: plan to run
+  @return: exit status of the last stage, or non-zero if it could not be run
+*/
+int execCommand(struct plan* plan)
+{
+  pid_t pids[plan->numStages];
+  struct stageResult results[plan->numStages];
+  if (plan->background) {
+    // with JOBBUF set the job writes into a pipe quash drains into a ring buffer
+    int outFds[2] = { -1, -1 };
+    if (jobOutputSize > 0 && makePipe(outFds) < 0) {
+      fprintf(stderr, "\nError creating pipe. Error:%d\n", errno);
+    }
+    // builtins in it have already finished by the time it is a job
+    int numStarted = execPipedCommand(plan, pids, results, outFds[1]);
+    if (outFds[1] >= 0) {
+      close(outFds[1]);
+    }
+    if (numStarted <= 0) {
+      if (outFds[0] >= 0) {
+        close(outFds[0]);
+      }
+      return -1;
+    }
+    return execBackgroundCommand(plan, pids, outFds[0]);
+  }
+
+  //prevent control-c from killing quash
+  signal(SIGINT, preventProgramKill);	 
+  int ret = -1;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (execPipedCommand(plan, pids, results, -1) > 0) {
+    ret = waitForStages(plan, pids, results);
+    int i = 0;
+    for (; i < plan->numStages; ++i) {
+      if (pids[i] > 0 && results[i].done) {
+        recordLatency(HIST_EXEC_TO_EXIT, (long long) (elapsed(&start, &results[i].end) * 1e9));
+      }
+    }
+    if (plan->timed) {
+      printTimes(plan, pids, results, &start);
+    }
+  }
+  //control c can terminate entire quash again
+  signal(SIGINT, allowProgramKill);
+  return ret;
+}
+
+/*
+  Waits for every stage of a foreground pipeline. Children are reaped in
+  the order they exit so each stage's end time and resource usage are its
+  own; anything else that exits meanwhile is passed on to the job table.
+  @param plan: plan that was launched
+  @param pids: pid of each stage, 0 for builtins, negative for stages that
+    failed to start
+  @param results: [in/out] exit status, usage & end time of each stage,
+    already filled in for builtins
+  @return: exit status of the last stage
+*/
+int waitForStages(struct plan* plan, pid_t pids[], struct stageResult* results)
+{
+  int numRunning = 0;
+  int i = 0;
+  for (; i < plan->numStages; ++i) {
+    if (pids[i] <= 0) {
+      continue;
+    }
+    // a builtin that waits for children of its own may have reaped it already
+    struct exitRecord record;
+    if (takeStashedExit(pids[i], &record)) {
+      results[i].status = record.status;
+      results[i].usage = record.usage;
+      results[i].end = record.end;
+      results[i].done = 1;
+      continue;
+    }
+    numRunning++;
+  }
+  long long waitStart = nowNs();
+  while (numRunning > 0) {
+    int status;
+    struct rusage usage;
+    // background jobs keep writing into their ring buffers meanwhile
+    pid_t pid = wait4(-1, &status, jobOutputEpollFd >= 0 ? WNOHANG : 0, &usage);
+    if (pid == 0) {
+      waitForChildOrOutput();
+      continue;
+    }
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "\nError waiting for pipeline. Error#%d\n", errno);
+      break;
+    }
+    for (i = 0; i < plan->numStages && pids[i] != pid; ++i) {}
+    if (i == plan->numStages) {
+      // a background job or someone else's child
+      recordExit(pid, status, &usage);
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &results[i].end);
+    results[i].status = status;
+    results[i].usage = usage;
+    results[i].done = 1;
+    numRunning--;
+  }
+  recordLatency(HIST_WAIT, nowNs() - waitStart);
+  flushJobReports();
+
+  int last = plan->numStages - 1;
+  if (pids[last] < 0) {
+    return 127;
+  }
+  if (!results[last].done) {
+    return -1;
+  }
+  return exitCode(results[last].status);
+}
+
+/*
+  Prints the time & resources each stage of a timed pipeline used, then
+  the totals for the whole pipeline
+  @param plan: plan that was run
+  @param pids: pid of each stage, negative for stages that failed to start
+  @param results: what each stage used, from waitForStages
+  @param start: when the pipeline was started
+*/
+void printTimes(struct plan* plan, pid_t pids[], struct stageResult* results, struct timespec* start)
+{
+  struct rusage total;
+  memset(&total, 0, sizeof(total));
+  struct timespec end = *start;
+  fprintf(stderr, "%-6s %9s %9s %9s %10s %7s %7s  %s\n", "stage", "real", "user", "sys", "maxrss", "vcsw", "ivcsw", "command");
+  int i = 0;
+  for (; i < plan->numStages; ++i) {
+    if (pids[i] < 0 || !results[i].done) {
+      fprintf(stderr, "%-6d %9s  %s\n", i + 1, "-", plan->stages[i].argv[0]);
+      continue;
+    }
+    struct rusage* usage = &results[i].usage;
+    fprintf(stderr, "%-6d %8.3fs %8.3fs %8.3fs %8ldKB %7ld %7ld  %s\n", i + 1,
+            elapsed(start, &results[i].end), seconds(&usage->ru_utime), seconds(&usage->ru_stime),
+            usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw, plan->stages[i].argv[0]);
+    timeradd(&total.ru_utime, &usage->ru_utime, &total.ru_utime);
+    timeradd(&total.ru_stime, &usage->ru_stime, &total.ru_stime);
+    if (usage->ru_maxrss > total.ru_maxrss) {
+      total.ru_maxrss = usage->ru_maxrss;
+    }
+    total.ru_nvcsw += usage->ru_nvcsw;
+    total.ru_nivcsw += usage->ru_nivcsw;
+    if (elapsed(&end, &results[i].end) > 0) {
+      end = results[i].end;
+    }
+  }
+  // maxrss of the pipeline is its largest stage
+  fprintf(stderr, "%-6s %8.3fs %8.3fs %8.3fs %8ldKB %7ld %7ld\n", "total",
+          elapsed(start, &end), seconds(&total.ru_utime), seconds(&total.ru_stime),
+          total.ru_maxrss, total.ru_nvcsw, total.ru_nivcsw);
+}
+
+/*
+  @return: seconds from start to end
+*/
+double elapsed(struct timespec* start, struct timespec* end)
+{
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+  @return: tv in seconds
+*/
+double seconds(struct timeval* tv)
+{
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/*
+  @return: current time of the monotonic clock in nanoseconds
+*/
+long long nowNs()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+  Adds a latency sample to one of quash's histograms
+  @param which: histogram to add to, one of the HIST_ values
+  @param ns: sample in nanoseconds
+*/
+void recordLatency(int which, long long ns)
+{
+  struct histogram* hist = &quashStats.histograms[which];
+  if (ns < 0) {
+    ns = 0;
+  }
+  // bucket is the number of bits needed for ns, so it holds [2^(b-1), 2^b)
+  int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+  if (bucket >= HISTOGRAM_BUCKETS) {
+    bucket = HISTOGRAM_BUCKETS - 1;
+  }
+  hist->buckets[bucket]++;
+  if (hist->count == 0 || ns < hist->min) {
+    hist->min = ns;
+  }
+  if (ns > hist->max) {
+    hist->max = ns;
+  }
+  hist->count++;
+  hist->sum += ns;
+}
+
+/*
+  Converts a status from waitpid into a shell exit code
+  @param status: status from waitpid
+  @return: exit code, or 128 + signal number for a killed process
+*/
+int exitCode(int status)
+{
+  if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
+
+//when quash is execing a command, it cannot be killed.
+void preventProgramKill(int signal)
+{
+	printf("\n");
+} 
+
+//when program is outside of execing a command, it can be killed
+void allowProgramKill(int signal)
+{
+	printf("\n");
+	exit(0); 
+} 
+
+/*
+  Sets up the spawn attributes shared by every child: children start with
+  an empty signal mask and default handlers, regardless of what quash has
+  blocked or caught at the time of the spawn
+*/
+void initSpawnAttr()
+{
+  sigset_t childMask;
+  sigset_t childDefaults;
+  sigemptyset(&childMask);
+  sigemptyset(&childDefaults);
+  sigaddset(&childDefaults, SIGINT);
+  sigaddset(&childDefaults, SIGQUIT);
+  sigaddset(&childDefaults, SIGCHLD);
+  sigaddset(&childDefaults, SIGPIPE);
+
+  posix_spawnattr_init(&spawnAttr);
+  posix_spawnattr_setsigmask(&spawnAttr, &childMask);
+  posix_spawnattr_setsigdefault(&spawnAttr, &childDefaults);
+  posix_spawnattr_setflags(&spawnAttr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+}
+
+/*
+  Launches a command as a child process. Every exec path goes through here.
+  Uses posix_spawn, which glibc implements with clone(CLONE_VM|CLONE_VFORK),
+  so the cost of a launch does not grow with the size of quash's heap the
+  way fork's page table copy does. Failures to exec are reported back to
+  the parent instead of from inside the child. The command is resolved
+  through the PATH cache rather than by trying execve in each directory.
+  @param cmd: command vector to execute, NULL terminated
+  @param actions: dup2/open/close actions to apply in the child, may be NULL
+  @param pid: [out] pid of the new child
+  @return: 0 for success, non-zero otherwise
+*/
+int spawnCommand(char* cmd[], posix_spawn_file_actions_t* actions, pid_t* pid)
+{
+  // anything quash printed must come out before the child's output
+  fflush(stdout);
+  long long start = nowNs();
+  int err = ENOENT;
+  int fromCache = (strchr(cmd[0], '/') == NULL);
+  int attempt = 0;
+  for (; attempt < 2; ++attempt) {
+    char* path = lookupCommandPath(cmd[0]);
+    if (!path) {
+      err = ENOENT;
+      break;
+    }
+    err = posix_spawn(pid, path, actions, &spawnAttr, cmd, envBlock());
+    if (err == ENOEXEC) {
+      // no #! line, run it as a shell script like execvp does
+      int n = 0;
+      while (cmd[n] != 0) {
+        n++;
+      }
+      char* shCmd[n + 2];
+      shCmd[0] = "/bin/sh";
+      shCmd[1] = path;
+      memcpy(shCmd + 2, cmd + 1, n * sizeof(char*));
+      err = posix_spawn(pid, "/bin/sh", actions, &spawnAttr, shCmd, envBlock());
+    }
+    if ((err == ENOENT || err == EACCES) && fromCache) {
+      // binary moved or was removed since it was hashed, look it up again
+      forgetCommandPath(cmd[0]);
+      continue;
+    }
+    break;
+  }
+  recordLatency(HIST_SPAWN, nowNs() - start);
+  if (err != 0) {
+    if (err == ENOENT) {
+      fprintf(stderr, "\n%s not found.\n", cmd[0]);
+    }
+    else {
+      fprintf(stderr, "\nError execing %s. Error#%d\n", cmd[0], err);
+    }
+    return -1;
+  }
+  return 0;
+}
+
+/*
+  Hashes a command name (FNV-1a)
+  @param name: command name
+  @return: hash value
+*/
+unsigned long hashString(const char* name)
+{
+  unsigned long hash = 14695981039346656037UL;
+  while (*name) {
+    hash ^= (unsigned char) *name++;
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+/*
+  Hashes length bytes of data (FNV-1a)
+  @param data: bytes to hash
+  @param length: number of bytes
+  @return: hash value
+*/
+unsigned long hashBytes(const char* data, size_t length)
+{
+  unsigned long hash = 14695981039346656037UL;
+  size_t i;
+  for (i = 0; i < length; ++i) {
+    hash ^= (unsigned char) data[i];
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+/*
+  Searches each directory in PATH for an executable named name
+  @param name: command name without any '/'
+  @return: newly allocated absolute path, or NULL if not found
+*/
+char* searchPath(const char* name)
+{
+  char* pathVar = envGet("PATH");
+  if (!pathVar) {
+    pathVar = "/usr/local/bin:/usr/bin:/bin";
+  }
+  size_t nameLen = strlen(name);
+  const char* dir = pathVar;
+  while (1) {
+    const char* end = strchr(dir, ':');
+    size_t dirLen = end ? (size_t) (end - dir) : strlen(dir);
+    // an empty entry means the current directory
+    const char* dirName = dirLen ? dir : ".";
+    if (!dirLen) {
+      dirLen = 1;
+    }
+    char candidate[dirLen + nameLen + 2];
+    memcpy(candidate, dirName, dirLen);
+    candidate[dirLen] = '/';
+    memcpy(candidate + dirLen + 1, name, nameLen + 1);
+    struct stat info;
+    if (stat(candidate, &info) == 0 && S_ISREG(info.st_mode) && access(candidate, X_OK) == 0) {
+      return quashStrdup(candidate);
+    }
+    if (!end) {
+      return NULL;
+    }
+    dir = end + 1;
+  }
+}
+
+/*
+  Resolves a command name to the path it will be executed from, using the
+  PATH cache so each command only walks PATH the first time it is run
+  @param name: command name, returned unchanged if it contains a '/'
+  @return: path to execute, or NULL if the command can not be found
+*/
+char* lookupCommandPath(char* name)
+{
+  if (strchr(name, '/') != NULL) {
+    return name;
+  }
+  unsigned long hash = hashString(name);
+  struct pathEntry* entry = pathCache.buckets ? pathCache.buckets[hash & (pathCache.numBuckets - 1)] : NULL;
+  for (; entry != NULL; entry = entry->next) {
+    if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+      pathCache.hits++;
+      entry->hits++;
+      return entry->path;
+    }
+  }
+  pathCache.misses++;
+
+  char* path = searchPath(name);
+  if (!path) {
+    return NULL;
+  }
+  if (path[0] != '/') {
+    // relative PATH entries depend on the current directory, don't remember them
+    static char* relativePath = NULL;
+    free(relativePath);
+    relativePath = path;
+    return path;
+  }
+
+  // grow the table once it averages more than one entry per bucket
+  if (pathCache.count >= pathCache.numBuckets) {
+    int newNumBuckets = pathCache.numBuckets ? pathCache.numBuckets * 2 : 64;
+    struct pathEntry** newBuckets = quashCalloc(newNumBuckets, sizeof(struct pathEntry*));
+    if (!newBuckets) {
+      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+      free(path);
+      return NULL;
+    }
+    int i;
+    for (i = 0; i < pathCache.numBuckets; ++i) {
+      while (pathCache.buckets[i] != NULL) {
+        struct pathEntry* moved = pathCache.buckets[i];
+        pathCache.buckets[i] = moved->next;
+        moved->next = newBuckets[moved->hash & (newNumBuckets - 1)];
+        newBuckets[moved->hash & (newNumBuckets - 1)] = moved;
+      }
+    }
+    free(pathCache.buckets);
+    pathCache.buckets = newBuckets;
+    pathCache.numBuckets = newNumBuckets;
+  }
+
+  entry = quashMalloc(sizeof(struct pathEntry));
+  if (!entry) {
+    fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+    free(path);
+    return NULL;
+  }
+  entry->name = quashStrdup(name);
+  entry->path = path;
+  entry->hash = hash;
+  entry->hits = 1;
+  entry->next = pathCache.buckets[hash & (pathCache.numBuckets - 1)];
+  pathCache.buckets[hash & (pathCache.numBuckets - 1)] = entry;
+  pathCache.count++;
+  return path;
+}
+
+/*
+  Removes one command from the PATH cache
+  @param name: command name
+*/
+void forgetCommandPath(char* name)
+{
+  if (!pathCache.buckets) {
+    return;
+  }
+  unsigned long hash = hashString(name);
+  struct pathEntry** link = &pathCache.buckets[hash & (pathCache.numBuckets - 1)];
+  for (; *link != NULL; link = &(*link)->next) {
+    struct pathEntry* entry = *link;
+    if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+      *link = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+      pathCache.count--;
+      return;
+    }
+  }
+}
+
+/*
+  Empties the PATH cache, called whenever PATH changes
+*/
+void clearPathCache()
+{
+  int i;
+  for (i = 0; i < pathCache.numBuckets; ++i) {
+    while (pathCache.buckets[i] != NULL) {
+      struct pathEntry* entry = pathCache.buckets[i];
+      pathCache.buckets[i] = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+    }
+  }
+  pathCache.count = 0;
+}
+
+/*
+  Loads the environment quash was started with into the store
+  @param envp: environment from main
+  @return: 0 for success, non-zero for allocation error
+*/
+int initEnv(char* envp[])
+{
+  int i = 0;
+  for (; envp[i] != NULL; ++i) {
+    char* equals = strchr(envp[i], '=');
+    if (!equals) {
+      continue;
+    }
+    if (envPut(envp[i], equals - envp[i], equals + 1) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+  Finds a variable's entry in the environment store
+  @param name: start of the variable's name
+  @param nameLength: length of the name
+  @param hash: hashBytes of the name
+  @return: pointer to the link pointing at the entry, or at the NULL
+    ending its bucket when there is none
+*/
+struct envEntry** findEnvEntry(const char* name, size_t nameLength, unsigned long hash)
+{
+  struct envEntry** link = &envStore.buckets[hash & (envStore.numBuckets - 1)];
+  for (; *link != NULL; link = &(*link)->next) {
+    if ((*link)->hash == hash && (*link)->nameLength == nameLength
+        && memcmp((*link)->entry, name, nameLength) == 0) {
+      break;
+    }
+  }
+  return link;
+}
+
+/*
+  Sets a variable, the environment block is rebuilt before the next spawn
+  @param name: start of the variable's name, need not be null terminated
+  @param nameLength: length of the name
+  @param value: new value
+  @return: 0 for success, non-zero for allocation error
+*/
+int envPut(const char* name, size_t nameLength, const char* value)
+{
+  if (envStore.count >= envStore.numBuckets) {
+    // keep chains short, double the buckets and rehash
+    int newNumBuckets = envStore.numBuckets ? envStore.numBuckets * 2 : 64;
+    struct envEntry** newBuckets = quashCalloc(newNumBuckets, sizeof(struct envEntry*));
+    if (!newBuckets) {
+      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+      return -1;
+    }
+    int i = 0;
+    for (; i < envStore.numBuckets; ++i) {
+      struct envEntry* entry = envStore.buckets[i];
+      while (entry) {
+        struct envEntry* next = entry->next;
+        int bucket = entry->hash & (newNumBuckets - 1);
+        entry->next = newBuckets[bucket];
+        newBuckets[bucket] = entry;
+        entry = next;
+      }
+    }
+    free(envStore.buckets);
+    envStore.buckets = newBuckets;
+    envStore.numBuckets = newNumBuckets;
+  }
+
+  size_t valueLength = strlen(value);
+  char* text = quashMalloc(nameLength + valueLength + 2);
+  if (!text) {
+    fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+    return -1;
+  }
+  memcpy(text, name, nameLength);
+  text[nameLength] = '=';
+  memcpy(text + nameLength + 1, value, valueLength + 1);
+
+  unsigned long hash = hashBytes(name, nameLength);
+  struct envEntry** link = findEnvEntry(name, nameLength, hash);
+  if (*link) {
+    free((*link)->entry);
+    (*link)->entry = text;
+  }
+  else {
+    struct envEntry* entry = quashMalloc(sizeof(struct envEntry));
+    if (!entry) {
+      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+      free(text);
+      return -1;
+    }
+    entry->entry = text;
+    entry->nameLength = nameLength;
+    entry->hash = hash;
+    entry->next = NULL;
+    *link = entry;
+    envStore.count++;
+  }
+  envStore.dirty = 1;
+  return 0;
+}
+
+/*
+  Sets a variable
+  @param name: variable's name
+  @param value: new value
+  @return: 0 for success, non-zero for allocation error
+*/
+int envSet(const char* name, const char* value)
+{
+  return envPut(name, strlen(name), value);
+}
+
+/*
+  Looks up a variable
+  @param name: variable's name
+  @return: its value, NULL if it is not set. Valid until it is next changed.
+*/
+char* envGet(const char* name)
+{
+  if (envStore.numBuckets == 0) {
+    return NULL;
+  }
+  size_t nameLength = strlen(name);
+  struct envEntry* entry = *findEnvEntry(name, nameLength, hashBytes(name, nameLength));
+  return entry ? entry->entry + nameLength + 1 : NULL;
+}
+
+/*
+  Removes a variable
+  @param name: variable's name
+*/
+void envUnset(const char* name)
+{
+  if (envStore.numBuckets == 0) {
+    return;
+  }
+  size_t nameLength = strlen(name);
+  struct envEntry** link = findEnvEntry(name, nameLength, hashBytes(name, nameLength));
+  struct envEntry* entry = *link;
+  if (!entry) {
+    return;
+  }
+  *link = entry->next;
+  free(entry->entry);
+  free(entry);
+  envStore.count--;
+  envStore.dirty = 1;
+}
+
+/*
+  Gets the environment block passed to every spawned command. It is only
+  rebuilt after a variable changes, so a spawn normally costs nothing here.
+  @return: NULL terminated array of NAME=value strings
+*/
+char** envBlock()
+{
+  if (!envStore.dirty && envStore.block) {
+    return envStore.block;
+  }
+  char** block = quashRealloc(envStore.block, (envStore.count + 1) * sizeof(char*));
+  if (!block) {
+    fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+    // the old block is still whole, just out of date
+    return envStore.block;
+  }
+  int n = 0;
+  int i = 0;
+  for (; i < envStore.numBuckets; ++i) {
+    struct envEntry* entry = envStore.buckets[i];
+    for (; entry != NULL; entry = entry->next) {
+      block[n++] = entry->entry;
+    }
+  }
+  block[n] = NULL;
+  envStore.block = block;
+  envStore.dirty = 0;
+  return block;
+}
+
+/*
+  Creates a pipe whose ends are closed automatically on exec, so children
+  only keep the ends that were dup2'd onto their stdin/stdout
+  @param fds: [out] read end in fds[0], write end in fds[1]
+  @return: 0 for success, non-zero otherwise
+*/
+int makePipe(int fds[2])
+{
+  if (pipe(fds) < 0) {
+    return -1;
+  }
+  quashStats.pipes++;
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  return 0;
+}
+
+/*
+  Sets the capacity of a pipe to the PIPESZ option, so stages of a busy
+  pipeline block on full or empty pipes less often. Linux only.
+  @param fd: either end of the pipe
+  @return: 0 for success, non-zero otherwise
+*/
+int setPipeSize(int fd)
+{
+#ifdef F_SETPIPE_SZ
+  if (fcntl(fd, F_SETPIPE_SZ, (int) pipeSize) < 0) {
+    return -1;
+  }
+  return 0;
+#else
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+/*
+  Launches every stage of a plan, connected by pipes, with each stage's
+  redirects applied after its pipes. Builtin stages are run to completion
+  inside quash once the other stages are running.
+  @param plan: plan to launch
+  @param pids: [out] pid of each stage, 0 for builtins and -1 for stages
+    that failed to start
+  @param results: [out] how each builtin stage ended, done is cleared for the rest
+  @return: number of stages started, negative if the pipes could not be made
+*/
+int execPipedCommand(struct plan* plan, pid_t pids[], struct stageResult* results, int outFd)
+{
+  int numCmds = plan->numStages;
+  int numPipes = numCmds - 1;
+  int numStarted = 0;
+  // create all pipes
+  int pipefds[numPipes * 2 + 1];
+  int i = 0;
+  for (; i < numPipes; ++i) {
+    if (makePipe(pipefds + (i * 2)) < 0) {
+      fprintf(stderr, "\nError creating pipe %d. Error:%d\n", (i * 2), errno);
+      int j = 0;
+      for (; j < i * 2; ++j) {
+        close(pipefds[j]);
+      }
+      return -1;
+    }
+    if (pipeSize > 0 && setPipeSize(pipefds[i * 2]) < 0 && i == 0) {
+      // only complain once per pipeline
+      fprintf(stderr, "\nError setting pipe size to %ld. Error:%d\n", pipeSize, errno);
+    }
+  }
+
+  // spawn all child processes, builtins run after so whatever reads their output is already running
+  int j = 0;
+  for (; j < numCmds; ++j) {
+    struct stage* stage = &plan->stages[j];
+    results[j].done = 0;
+    if (isBuiltin(stage->argv[0])) {
+      quashStats.builtins++;
+      pids[j] = 0;
+      continue;
+    }
+    quashStats.external++;
+    pids[j] = -1;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    // if not first command, set up input pipe
+    if (j != 0) {
+      posix_spawn_file_actions_adddup2(&actions, pipefds[(j - 1) * 2], STDIN_FILENO);
+    }
+    // if not last command, set up output pipe
+    if (j != numCmds - 1) {
+      posix_spawn_file_actions_adddup2(&actions, pipefds[(j * 2) + 1], STDOUT_FILENO);
+    }
+    else if (outFd >= 0) {
+      posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+    }
+    if (outFd >= 0) {
+      posix_spawn_file_actions_adddup2(&actions, outFd, STDERR_FILENO);
+    }
+    // open redirect files here so errors are reported against the file, not the command
+    int fds[stage->numRedirects + 1];
+    int numOpened = openRedirects(stage, fds);
+    for (i = 0; i < numOpened; ++i) {
+      posix_spawn_file_actions_adddup2(&actions, fds[i], stage->redirects[i].fd);
+    }
+    // remaining pipe ends and files are close-on-exec
+    int placed = 0;
+#ifdef __linux__
+    if (stage->placement) {
+      placed = applyPlacement(stage->placement);
+    }
+#endif
+    int spawned = -1;
+    if (numOpened >= 0 && placed == 0) {
+      spawned = plan->schedClass ? spawnInSchedClass(stage->argv, &actions, &pids[j], plan->schedClass)
+                                 : spawnCommand(stage->argv, &actions, &pids[j]);
+    }
+    if (spawned == 0) {
+      numStarted++;
+    }
+    else {
+      pids[j] = -1;
+    }
+#ifdef __linux__
+    if (stage->placement && placed == 0) {
+      restorePlacement(stage->placement);
+    }
+#endif
+    posix_spawn_file_actions_destroy(&actions);
+    for (i = 0; i < numOpened; ++i) {
+      close(fds[i]);
+    }
+  }
+
+  // write ends of spawned stages are only needed in the children, a
+  // builtin reading the pipe must see end of input once the writer exits;
+  // likewise the read ends of spawned stages, so a builtin writing into
+  // the pipe gets EPIPE once the reader exits
+  for (i = 0; i < numPipes; ++i) {
+    if (pids[i] != 0) {
+      close(pipefds[(i * 2) + 1]);
+      pipefds[(i * 2) + 1] = -1;
+    }
+    if (pids[i + 1] != 0) {
+      close(pipefds[i * 2]);
+      pipefds[i * 2] = -1;
+    }
+  }
+
+  // run builtins in quash itself instead of in a child
+  for (j = 0; j < numCmds; ++j) {
+    if (pids[j] != 0) {
+      continue;
+    }
+    int in = (j != 0) ? pipefds[(j - 1) * 2] : -1;
+    int out = -1;
+    if (j != numCmds - 1) {
+      // builtins never read their input, so output into one is thrown away
+      // rather than left to fill a pipe nobody drains
+      out = pids[j + 1] == 0 ? open("/dev/null", O_WRONLY | O_CLOEXEC) : pipefds[(j * 2) + 1];
+    }
+    runBuiltinStage(findBuiltin(plan->stages[j].argv[0]), &plan->stages[j], in, out, &results[j]);
+    if (j != numCmds - 1) {
+      // done writing, the next stage sees end of input
+      close(out);
+      if (pids[j + 1] != 0) {
+        pipefds[(j * 2) + 1] = -1;
+      }
+    }
+    // the read end is done with, a process still writing gets SIGPIPE
+    if (j != 0) {
+      close(in);
+      pipefds[(j - 1) * 2] = -1;
+    }
+    numStarted++;
+  }
+
+  // close all pipes
+  i = 0;
+  for (; i < numPipes * 2; ++i) {
+    if (pipefds[i] >= 0) {
+      close(pipefds[i]);
+    }
+  }
+  return numStarted;
+}
+
+/*
+  Runs a builtin stage inside quash. Its stdout is pointed at the pipe or
+  file it would have written to as a process, and put back afterwards.
+  @param builtin: builtin to run
+  @param stage: stage being run
+  @param in: fd its input comes from, -1 for quash's own input
+  @param out: fd its output goes to, -1 for quash's own stdout
+  @param result: [out] exit status & usage of the builtin
+*/
+void runBuiltinStage(const struct builtin* builtin, struct stage* stage, int in, int out,
+                     struct stageResult* result)
+{
+  int fds[stage->numRedirects + 1];
+  int numOpened = openRedirects(stage, fds);
+  if (numOpened < 0) {
+    result->status = W_EXITCODE(1, 0);
+    result->done = 1;
+    return;
+  }
+  // later redirects win, like dup2s applied in order
+  int i = 0;
+  for (; i < numOpened; ++i) {
+    if (stage->redirects[i].fd == STDIN_FILENO) {
+      in = fds[i];
+    }
+    else {
+      out = fds[i];
+    }
+  }
+
+  fflush(stdout);
+  int savedOut = -1;
+  if (out >= 0) {
+    savedOut = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(out, STDOUT_FILENO);
+  }
+  builtinInput = in;
+  struct rusage selfBefore, childrenBefore, selfAfter, childrenAfter;
+  getrusage(RUSAGE_SELF, &selfBefore);
+  getrusage(RUSAGE_CHILDREN, &childrenBefore);
+  int numStashed = exitStash.count;
+  // a reader that exits early makes writes fail with EPIPE rather than kill quash
+  void (*oldPipeHandler)(int) = signal(SIGPIPE, SIG_IGN);
+
+  int ret = builtin->run(stage->argv);
+
+  signal(SIGPIPE, oldPipeHandler);
+
+  getrusage(RUSAGE_SELF, &selfAfter);
+  getrusage(RUSAGE_CHILDREN, &childrenAfter);
+  builtinInput = -1;
+  fflush(stdout);
+  if (savedOut >= 0) {
+    dup2(savedOut, STDOUT_FILENO);
+    close(savedOut);
+  }
+  for (i = 0; i < numOpened; ++i) {
+    close(fds[i]);
+  }
+
+  // usage is what quash and any children the builtin waited for used meanwhile
+  memset(&result->usage, 0, sizeof(result->usage));
+  timersub(&selfAfter.ru_utime, &selfBefore.ru_utime, &result->usage.ru_utime);
+  timersub(&selfAfter.ru_stime, &selfBefore.ru_stime, &result->usage.ru_stime);
+  timersub(&childrenAfter.ru_utime, &childrenBefore.ru_utime, &selfBefore.ru_utime);
+  timersub(&childrenAfter.ru_stime, &childrenBefore.ru_stime, &selfBefore.ru_stime);
+  // children reaped meanwhile but left in the stash, like the other stages, are not the builtin's
+  for (i = numStashed; i < exitStash.count; ++i) {
+    timersub(&selfBefore.ru_utime, &exitStash.records[i].usage.ru_utime, &selfBefore.ru_utime);
+    timersub(&selfBefore.ru_stime, &exitStash.records[i].usage.ru_stime, &selfBefore.ru_stime);
+  }
+  timeradd(&result->usage.ru_utime, &selfBefore.ru_utime, &result->usage.ru_utime);
+  timeradd(&result->usage.ru_stime, &selfBefore.ru_stime, &result->usage.ru_stime);
+  result->usage.ru_maxrss = selfAfter.ru_maxrss;
+  result->usage.ru_nvcsw = selfAfter.ru_nvcsw - selfBefore.ru_nvcsw;
+  result->usage.ru_nivcsw = selfAfter.ru_nivcsw - selfBefore.ru_nivcsw;
+  clock_gettime(CLOCK_MONOTONIC, &result->end);
+  result->status = W_EXITCODE(ret & 0xff, 0);
+  result->done = 1;
+}
+
+/*
+  Opens the files a stage redirects to
+  @param stage: stage whose redirects to open
+  @param fds: [out] fd of each redirect, in order
+  @return: number opened, negative if one could not be opened (none are left open)
+*/
+int openRedirects(struct stage* stage, int fds[])
+{
+  int i = 0;
+  for (; i < stage->numRedirects; ++i) {
+    struct redirect* redirect = &stage->redirects[i];
+    if (redirect->kind == REDIRECT_HERE) {
+      fds[i] = openHereText(redirect->path);
+      if (fds[i] < 0) {
+        while (i-- > 0) {
+          close(fds[i]);
+        }
+        return -1;
+      }
+      continue;
+    }
+    if (redirect->kind == REDIRECT_COPROC) {
+      struct coproc* coproc = findCoproc(redirect->path);
+      int fd = !coproc ? -1 : (redirect->fd == STDIN_FILENO) ? coproc->fromFd : coproc->toFd;
+      if (fd < 0) {
+        fprintf(stderr, "%s: no such coproc\n", redirect->path);
+        while (i-- > 0) {
+          close(fds[i]);
+        }
+        return -1;
+      }
+      // a copy, so the stage can close it like any other redirect
+      fds[i] = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+      continue;
+    }
+    fds[i] = open(redirect->path, redirect->flags | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fds[i] < 0) {
+      fprintf(stderr, "\nError opening %s. Error#%d\n", redirect->path, errno);
+      while (i-- > 0) {
+        close(fds[i]);
+      }
+      return -1;
+    }
+  }
+  return i;
+}
+
+/*
+  Makes an fd to read the text of a here-document or here-string from.
+  Text that fits in a pipe is written to one, anything bigger goes in a
+  sealed memfd so it never touches the disk.
+  @param text: null terminated text
+  @return: fd positioned at the start of the text, negative for error
+*/
+int openHereText(const char* text)
+{
+  size_t length = strlen(text);
+  if (length <= PIPE_BUF) {
+    // an empty pipe always takes PIPE_BUF bytes without blocking
+    int fds[2];
+    if (makePipe(fds) < 0) {
+      fprintf(stderr, "\nError creating pipe. Error:%d\n", errno);
+      return -1;
+    }
+    if (write(fds[1], text, length) != (ssize_t) length) {
+      fprintf(stderr, "\nError writing here-document. Error:%d\n", errno);
+      close(fds[0]);
+      close(fds[1]);
+      return -1;
+    }
+    close(fds[1]);
+    return fds[0];
+  }
+  int fd = makeMemoryFile("quash-here");
+  if (fd < 0) {
+    fprintf(stderr, "\nError creating here-document. Error:%d\n", errno);
+    return -1;
+  }
+  size_t written = 0;
+  while (written < length) {
+    ssize_t n = write(fd, text + written, length - written);
+    if (n < 0) {
+      fprintf(stderr, "\nError writing here-document. Error:%d\n", errno);
+      close(fd);
+      return -1;
+    }
+    written += n;
+  }
+#ifdef __linux__
+  // nothing can change the text under the command reading it
+  fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+  lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
+/*
+  Makes an anonymous close-on-exec file that lives in memory, or an
+  unlinked temp file where there is no memfd
+  @param name: name shown for it in /proc
+  @return: fd of the empty file, negative for error
+*/
+int makeMemoryFile(const char* name)
+{
+#ifdef __linux__
+  return memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+  (void) name;
+  char path[] = "/tmp/quash-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd >= 0) {
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  return fd;
+#endif
+}
+
+/*
+  Registers a launched plan as a background job
+  @param plan: plan that was launched
+  @param pids: pid of each stage, -1 for stages that failed to start
+  @return: 0 for success, non-zero otherwise
+*/
+int execBackgroundCommand(struct plan* plan, pid_t pids[], int outFd)
+{
+  // children are only reaped from the event loop, so the job is always
+  // set up before its exit can be seen
+  pid_t started[plan->numStages];
+  int numStarted = 0;
+  int i;
+  for (i = 0; i < plan->numStages; ++i) {
+    if (pids[i] > 0) {
+      started[numStarted++] = pids[i];
+    }
+  }
+  if (numStarted == 0) {
+    // only builtins, which have already run
+    if (outFd >= 0) {
+      close(outFd);
+    }
+    return 0;
+  }
+
+  //create new job in job table with all job information
+  int jobid = addJob(started, numStarted, plan->text);
+  if (jobid < 0) {
+    if (outFd >= 0) {
+      close(outFd);
+    }
+    return -1;
+  }
+  if (outFd >= 0) {
+    captureJobOutput(jobid, outFd);
+  }
+  if (plan->schedClass) {
+    jobTable.jobs[jobid].schedClass = *plan->schedClass;
+  }
+  printf("[%d] %d running in background\n", jobid, jobTable.jobs[jobid].pid); 
+  return 0;
+}
+
+/*
+  Starts keeping a background job's output in a ring buffer instead of
+  letting it write to the terminal. The pipe it writes to is drained
+  without blocking whenever epoll reports it readable.
+  @param jobid: job whose stdout & stderr go into the pipe
+  @param fd: read end of the pipe
+  @return: 0 for success, non-zero otherwise (fd is closed)
+*/
+int captureJobOutput(int jobid, int fd)
+{
+#ifdef __linux__
+  if (jobOutputEpollFd < 0) {
+    // one epoll instance for every job's pipe, watched as a whole by the main one
+    jobOutputEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = jobOutputEpollFd;
+    if (jobOutputEpollFd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, jobOutputEpollFd, &event) < 0) {
+      fprintf(stderr, "\nError creating epoll instance. Error:%d\n", errno);
+      if (jobOutputEpollFd >= 0) {
+        close(jobOutputEpollFd);
+        jobOutputEpollFd = -1;
+      }
+      close(fd);
+      return -1;
+    }
+  }
+  struct outputRing* ring = quashMalloc(sizeof(struct outputRing));
+  char* buf = quashMalloc(jobOutputSize);
+  if (!ring || !buf) {
+    fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+    free(ring);
+    free(buf);
+    close(fd);
+    return -1;
+  }
+  ring->jobid = jobid;
+  ring->fd = fd;
+  ring->buf = buf;
+  ring->size = jobOutputSize;
+  ring->start = 0;
+  ring->length = 0;
+  ring->dropped = 0;
+  ring->attached = 0;
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u32 = jobid;
+  if (epoll_ctl(jobOutputEpollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    fprintf(stderr, "\nError watching job output. Error:%d\n", errno);
+    free(buf);
+    free(ring);
+    close(fd);
+    return -1;
+  }
+  jobTable.jobs[jobid].output = ring;
+  return 0;
+#else
+  close(fd);
+  return -1;
+#endif
+}
+
+/*
+  Reads whatever every background job has written so far into its ring
+  buffer, or onto the terminal for a job fg is attached to
+*/
+void drainJobOutputs()
+{
+#ifdef __linux__
+  if (jobOutputEpollFd < 0) {
+    return;
+  }
+  struct epoll_event events[64];
+  int numEvents;
+  do {
+    numEvents = epoll_wait(jobOutputEpollFd, events, 64, 0);
+    int i;
+    for (i = 0; i < numEvents; ++i) {
+      struct job* job = &jobTable.jobs[events[i].data.u32];
+      if (job->output) {
+        readJobOutput(job->output);
+      }
+    }
+  } while (numEvents == 64);
+#endif
+}
+
+/*
+  Reads a job's pipe until it is empty, closing it once every writer is gone
+  @param ring: output of the job
+*/
+void readJobOutput(struct outputRing* ring)
+{
+  char buf[65536];
+  while (ring->fd >= 0) {
+    ssize_t numRead = read(ring->fd, buf, sizeof(buf));
+    if (numRead > 0) {
+      if (ring->attached) {
+        fflush(stdout);
+        write(STDOUT_FILENO, buf, numRead);
+      }
+      else {
+        appendToRing(ring, buf, numRead);
+      }
+      continue;
+    }
+    if (numRead == 0 || (errno != EAGAIN && errno != EINTR)) {
+      // closing also takes it out of the epoll set
+      close(ring->fd);
+      ring->fd = -1;
+    }
+    if (numRead < 0 && errno == EINTR) {
+      continue;
+    }
+    break;
+  }
+}
+
+/*
+  Adds output to a ring buffer, dropping the oldest bytes once it is full
+  @param ring: ring to add to
+  @param data: output read from the job
+  @param length: length of data
+*/
+void appendToRing(struct outputRing* ring, const char* data, size_t length)
+{
+  if (length >= ring->size) {
+    // only the last size bytes survive
+    ring->dropped += ring->length + length - ring->size;
+    memcpy(ring->buf, data + length - ring->size, ring->size);
+    ring->start = 0;
+    ring->length = ring->size;
+    return;
+  }
+  if (ring->length + length > ring->size) {
+    size_t overflow = ring->length + length - ring->size;
+    ring->start = (ring->start + overflow) % ring->size;
+    ring->length -= overflow;
+    ring->dropped += overflow;
+  }
+  size_t end = (ring->start + ring->length) % ring->size;
+  size_t first = ring->size - end < length ? ring->size - end : length;
+  memcpy(ring->buf + end, data, first);
+  memcpy(ring->buf, data + first, length - first);
+  ring->length += length;
+}
+
+/*
+  Writes out what a ring buffer holds, oldest first
+  @param ring: ring to print
+  @param empty: whether to empty it afterwards
+*/
+void printRing(struct outputRing* ring, int empty)
+{
+  fflush(stdout);
+  if (ring->dropped > 0) {
+    printf("[%d] ... %llu earlier bytes dropped\n", ring->jobid, ring->dropped);
+    fflush(stdout);
+  }
+  size_t first = ring->size - ring->start < ring->length ? ring->size - ring->start : ring->length;
+  write(STDOUT_FILENO, ring->buf + ring->start, first);
+  write(STDOUT_FILENO, ring->buf, ring->length - first);
+  if (empty) {
+    ring->start = 0;
+    ring->length = 0;
+    ring->dropped = 0;
+  }
+}
+
+/*
+  Keeps the output of a job that finished so jobs -o and fg can still
+  show it, forgetting the oldest kept output when there are too many
+  @param job: job being removed from the table
+*/
+void keepJobOutput(struct job* job)
+{
+  struct outputRing* ring = job->output;
+  job->output = NULL;
+  // the last of what it wrote is still in the pipe
+  readJobOutput(ring);
+  if (ring->fd >= 0) {
+    // something it started still holds the pipe, stop listening to it
+    close(ring->fd);
+    ring->fd = -1;
+  }
+  if (ring->length == 0 || ring->attached) {
+    freeRing(ring);
+    return;
+  }
+  if (keptOutputs.count == MAX_KEPT_OUTPUTS) {
+    freeRing(keptOutputs.rings[0]);
+    memmove(keptOutputs.rings, keptOutputs.rings + 1, (MAX_KEPT_OUTPUTS - 1) * sizeof(struct outputRing*));
+    keptOutputs.count--;
+  }
+  keptOutputs.rings[keptOutputs.count++] = ring;
+}
+
+/*
+  Finds the captured output of a job
+  @param jobid: running job, or finished one whose output was kept
+  @param index: [out] index in keptOutputs for a finished job, -1 otherwise
+  @return: the output, NULL if none was captured
+*/
+struct outputRing* findJobOutput(int jobid, int* index)
+{
+  *index = -1;
+  if (jobid >= 0 && jobid < jobTable.used && !jobTable.jobs[jobid].finishedFlag) {
+    return jobTable.jobs[jobid].output;
+  }
+  int i = keptOutputs.count - 1;
+  for (; i >= 0; --i) {
+    if (keptOutputs.rings[i]->jobid == jobid) {
+      *index = i;
+      return keptOutputs.rings[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+  Frees a ring buffer
+  @param ring: ring whose pipe is closed
+*/
+void freeRing(struct outputRing* ring)
+{
+  free(ring->buf);
+  free(ring);
+}
+
+/*
+  Waits until a child exits or a background job writes output, draining
+  any job output in the meantime
+*/
+void waitForChildOrOutput()
+{
+  struct pollfd fds[2] = { { childEventFd, POLLIN, 0 }, { jobOutputEpollFd, POLLIN, 0 } };
+  if (poll(fds, 2, -1) <= 0) {
+    return;
+  }
+  if (fds[0].revents) {
+    // the caller reaps with WNOHANG next, which finds every exited child
+    clearChildEvents();
+  }
+  if (fds[1].revents) {
+    drainJobOutputs();
+  }
+}
+
+/*
+  Sets up the event loop that reaps children. On linux SIGCHLD stays
+  blocked and is read from a signalfd watched by epoll alongside input,
+  so child exits are handled in the main flow instead of a signal handler.
+  Elsewhere a SIGCHLD handler writes a byte to a pipe that is polled instead.
+  @return: 0 for success, non-zero otherwise
+*/
+int initEventLoop()
+{
+#ifdef __linux__
+  sigprocmask(SIG_BLOCK, &mask, &oldMask);
+  childEventFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (childEventFd < 0) {
+    fprintf(stderr, "\nError creating signalfd. Error:%d\n", errno);
+    return -1;
+  }
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFd < 0) {
+    fprintf(stderr, "\nError creating epoll instance. Error:%d\n", errno);
+    return -1;
+  }
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = childEventFd;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, childEventFd, &event) < 0) {
+    fprintf(stderr, "\nError watching signalfd. Error:%d\n", errno);
+    return -1;
+  }
+#else
+  if (makePipe(childEventPipe) < 0) {
+    fprintf(stderr, "\nError creating pipe. Error:%d\n", errno);
+    return -1;
+  }
+  fcntl(childEventPipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(childEventPipe[1], F_SETFL, O_NONBLOCK);
+  childEventFd = childEventPipe[0];
+  struct sigaction act;
+  act.sa_handler = childSignalHandler;
+  act.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigemptyset(&act.sa_mask);
+  if (sigaction(SIGCHLD, &act, NULL) < 0) {
+    fprintf(stderr, "Error in handling child signal: Error%d\n", errno);
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+#ifndef __linux__
+/*
+  Wakes up the event loop when a child exits. Only write() is called,
+  which is safe inside a signal handler.
+*/
+void childSignalHandler(int signal)
+{
+  int savedErrno = errno;
+  char c = 0;
+  write(childEventPipe[1], &c, 1);
+  errno = savedErrno;
+}
+#endif
+
+/*
+  Clears pending child exit notifications. Whoever calls this reaps with
+  waitpid next, and a child exiting after that wakes the event loop again.
+*/
+void clearChildEvents()
+{
+#ifdef __linux__
+  struct signalfd_siginfo info[32];
+#else
+  char info[64];
+#endif
+  while (read(childEventFd, info, sizeof(info)) > 0) {}
+}
+
+/*
+  Reaps every child that has exited and records a report for each
+  background job among them. The reports are printed together in one write
+  rather than one printf per child.
+  @return: number of finished jobs reported
+*/
+int reapChildren()
+{
+  // clear pending notifications first, a child exiting after this wakes us again
+  clearChildEvents();
+
+  int numReported = 0;
+  int status;
+  struct rusage usage;
+  pid_t pid;
+  while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+    numReported += recordExit(pid, status, &usage);
+  }
+  flushJobReports();
+  return numReported;
+}
+
+/*
+  Hands a reaped child to whoever is interested in it: a background job
+  gets a report queued once its last process is gone, anything else is
+  stashed for claimChild
+  @param pid: pid of the child
+  @param status: status from wait4
+  @param usage: resources the child used, from wait4
+  @return: 1 if a finished job was reported, 0 otherwise
+*/
+int recordExit(pid_t pid, int status, struct rusage* usage)
+{
+  int jobid = findJobByPid(pid);
+  if (jobid < 0) {
+    // not a job, keep its status for whoever started it
+    stashExit(pid, status, usage);
+    return 0;
+  }
+  finishCoproc(pid);
+  if (!finishJobProcess(jobid, pid, status)) {
+    // rest of the pipeline is still running
+    return 0;
+  }
+  // found background job that completed
+  struct job* job = &jobTable.jobs[jobid];
+  recordLatency(HIST_EXEC_TO_EXIT, nowNs() - job->started);
+  if (job->waitedFor > 0 && waitState.targets) {
+    // the same job may be named more than once
+    int t = job->waitedFor - 1;
+    for (; t < waitState.numTargets; ++t) {
+      struct waitTarget* target = &waitState.targets[t];
+      if (target->jobid == jobid && !target->done) {
+        target->status = exitCode(job->status);
+        target->done = 1;
+      }
+    }
+    waitState.remaining--;
+    if (waitState.firstDone < 0) {
+      waitState.firstDone = job->waitedFor - 1;
+    }
+  }
+  else {
+    rememberFinishedJob(job);
+  }
+  char report[256];
+  int length = snprintf(report, sizeof(report), "[%d] %d finished %s\n", jobid, jobTable.jobs[jobid].pid, jobTable.jobs[jobid].bgcommand);
+  if (length >= (int) sizeof(report)) {
+    length = sizeof(report) - 1;
+  }
+  if (jobReports.length + length > jobReports.size) {
+    size_t newSize = jobReports.size ? jobReports.size * 2 : 4096;
+    while (newSize < jobReports.length + length) {
+      newSize *= 2;
+    }
+    char* grown = quashRealloc(jobReports.buf, newSize);
+    if (!grown) {
+      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+      removeJob(jobid);
+      return 0;
+    }
+    jobReports.buf = grown;
+    jobReports.size = newSize;
+  }
+  memcpy(jobReports.buf + jobReports.length, report, length);
+  jobReports.length += length;
+  // free slot for reuse
+  removeJob(jobid);
+  return 1;
+}
+
+/*
+  Prints every queued job report in one write
+*/
+void flushJobReports()
+{
+  if (jobReports.length > 0) {
+    fflush(stdout);
+    write(STDOUT_FILENO, jobReports.buf, jobReports.length);
+    jobReports.length = 0;
+  }
+}
+
+/*
+  Blocks until fd has input to read, reaping children and reporting
+  finished jobs whenever they exit in the meantime
+  @param fd: file descriptor about to be read
+  @return: 0 when fd is readable, non-zero for error
+*/
+int waitForInput(int fd)
+{
+#ifdef __linux__
+  if (epollInputFd != fd) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      // regular files can't be watched, but they never block either
+      return 0;
+    }
+    if (epollInputFd >= 0) {
+      epoll_ctl(epollFd, EPOLL_CTL_DEL, epollInputFd, NULL);
+    }
+    epollInputFd = fd;
+  }
+#endif
+  while (1) {
+    int inputReady = 0;
+    int childReady = 0;
+#ifdef __linux__
+    struct epoll_event events[3];
+    int numEvents = epoll_wait(epollFd, events, 3, -1);
+    int i;
+    for (i = 0; i < numEvents; ++i) {
+      if (events[i].data.fd == childEventFd) {
+        childReady = 1;
+      }
+      else if (events[i].data.fd == jobOutputEpollFd) {
+        drainJobOutputs();
+      }
+      else {
+        inputReady = 1;
+      }
+    }
+#else
+    struct pollfd fds[2] = { { fd, POLLIN, 0 }, { childEventFd, POLLIN, 0 } };
+    int numEvents = poll(fds, 2, -1);
+    inputReady = numEvents > 0 && fds[0].revents != 0;
+    childReady = numEvents > 0 && fds[1].revents != 0;
+#endif
+    if (numEvents < 0 && errno != EINTR) {
+      fprintf(stderr, "\nError waiting for input. Error:%d\n", errno);
+      return -1;
+    }
+    if (childReady && reapChildren() > 0 && interactive) {
+      // reports went out over the prompt, show it again
+      printPrompt();
+    }
+    if (inputReady) {
+      return 0;
+    }
+  }
+}
+
+/*
+  Remembers the exit status of a child reaped by reapChildren that is not
+  a background job, so whatever started it can still collect it along
+  with the time it was reaped and the resources it used
+  @param pid: pid of the child
+  @param status: status from wait4
+  @param usage: resources the child used, from wait4
+*/
+void stashExit(pid_t pid, int status, struct rusage* usage)
+{
+  if (exitStash.count == exitStash.size) {
+    int newSize = exitStash.size ? exitStash.size * 2 : 16;
+    struct exitRecord* grown = quashRealloc(exitStash.records, newSize * sizeof(struct exitRecord));
+    if (!grown) {
+      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+      return;
+    }
+    exitStash.records = grown;
+    exitStash.size = newSize;
+  }
+  struct exitRecord* record = &exitStash.records[exitStash.count++];
+  record->pid = pid;
+  record->status = status;
+  record->usage = *usage;
+  clock_gettime(CLOCK_MONOTONIC, &record->end);
+}
+
+/*
+  Empties the stash once a command line is done. Every child it started
+  has been claimed by then, so what is left belongs to nobody, and its
+  pid could be reused by a child of the next line.
+*/
+void forgetUnclaimedExits()
+{
+  exitStash.count = 0;
+}
+
+/*
+  Takes a child's exit out of the stash if reapChildren already reaped it
+  @param pid: pid of the child
+  @param record: [out] status, usage & reap time of the child
+  @return: 1 if the child was in the stash, 0 otherwise
+*/
+int takeStashedExit(pid_t pid, struct exitRecord* record)
+{
+  int i;
+  for (i = 0; i < exitStash.count; ++i) {
+    if (exitStash.records[i].pid == pid) {
+      *record = exitStash.records[i];
+      exitStash.records[i] = exitStash.records[--exitStash.count];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+  Collects the exit status of a child started outside the job table
+  without blocking, whether or not reapChildren got to it first
+  @param pid: pid of the child
+  @param status: [out] status from waitpid
+  @return: 1 if the child has exited, 0 if it is still running, negative for error
+*/
+int claimChild(pid_t pid, int* status)
+{
+  struct exitRecord record;
+  if (takeStashedExit(pid, &record)) {
+    *status = record.status;
+    return 1;
+  }
+  pid_t ret = waitpid(pid, status, WNOHANG);
+  if (ret < 0) {
+    return -1;
+  }
+  return ret == pid;
+}
+
+/*
+  Runs tasks with at most maxRunning in flight, capturing each task's
+  stdout & stderr through a pipe so the output of one task is printed in
+  one piece when it finishes instead of interleaving with the others.
+  Blocks in poll on the output pipes and the child event fd, never spins.
+  @param maxRunning: most tasks to run at once
+  @param keepOrder: print output in task order rather than finishing order
+  @param startTask: starts task number index with its stdout/stderr on
+    outFd, returns 0 once started, 1 if there are no more tasks, negative
+    if the task could not be started (counted as failed)
+  @param finishTask: called with each task's exit status and output in the
+    order they are printed, NULL to just write the output to stdout
+  @param ctx: passed to startTask and finishTask
+  @return: number of tasks that failed
+*/
+int runTaskPool(int maxRunning, int keepOrder,
+                int (*startTask)(void* ctx, int index, int outFd, pid_t* pid),
+                void (*finishTask)(void* ctx, int index, int status, char* out, size_t length),
+                void* ctx)
+{
+  struct task tasks[maxRunning];
+  struct pollfd fds[maxRunning + 1];
+  // tasks that finished before an earlier one when keeping order
+  struct task* waiting = NULL;
+  int numWaiting = 0;
+  int waitingSize = 0;
+  int nextToPrint = 0;
+  int numRunning = 0;
+  int numStarted = 0;
+  int numFailed = 0;
+  int moreTasks = 1;
+  int i;
+  for (i = 0; i < maxRunning; ++i) {
+    tasks[i].pid = 0;
+  }
+
+  while (moreTasks || numRunning > 0) {
+    // fill free slots
+    for (i = 0; i < maxRunning && moreTasks; ++i) {
+      if (tasks[i].pid != 0) {
+        continue;
+      }
+      int pipefds[2];
+      if (makePipe(pipefds) < 0) {
+        fprintf(stderr, "\nError creating pipe. Error:%d\n", errno);
+        moreTasks = 0;
+        break;
+      }
+      pid_t pid;
+      int ret = startTask(ctx, numStarted, pipefds[1], &pid);
+      close(pipefds[1]);
+      if (ret != 0) {
+        close(pipefds[0]);
+        if (ret > 0) {
+          moreTasks = 0;
+        }
+        else {
+          // could not start, report it like a failed task
+          numFailed++;
+          struct task failed = { .index = numStarted, .status = EXIT_FAILURE << 8 };
+          numStarted++;
+          printTask(&failed, keepOrder, &waiting, &numWaiting, &waitingSize, &nextToPrint, finishTask, ctx);
+        }
+        continue;
+      }
+      fcntl(pipefds[0], F_SETFL, O_NONBLOCK);
+      tasks[i].pid = pid;
+      tasks[i].index = numStarted++;
+      tasks[i].outFd = pipefds[0];
+      tasks[i].out = NULL;
+      tasks[i].length = 0;
+      tasks[i].size = 0;
+      tasks[i].exited = 0;
+      numRunning++;
+    }
+    if (numRunning == 0) {
+      continue;
+    }
+
+    // wait for output or a child exit
+    int numFds = 0;
+    for (i = 0; i < maxRunning; ++i) {
+      if (tasks[i].pid != 0 && tasks[i].outFd >= 0) {
+        fds[numFds].fd = tasks[i].outFd;
+        fds[numFds].events = POLLIN;
+        numFds++;
+      }
+    }
+    fds[numFds].fd = childEventFd;
+    fds[numFds].events = POLLIN;
+    if (poll(fds, numFds + 1, -1) < 0 && errno != EINTR) {
+      fprintf(stderr, "\nError waiting for tasks. Error:%d\n", errno);
+      break;
+    }
+    if (fds[numFds].revents) {
+      // stash every exit with its own end time & usage for claimChild
+      reapChildren();
+    }
+
+    for (i = 0; i < maxRunning; ++i) {
+      struct task* task = &tasks[i];
+      if (task->pid == 0) {
+        continue;
+      }
+      // collect output
+      while (task->outFd >= 0) {
+        if (task->length == task->size) {
+          size_t newSize = task->size ? task->size * 2 : 4096;
+          char* grown = quashRealloc(task->out, newSize);
+          if (!grown) {
+            fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+            break;
+          }
+          task->out = grown;
+          task->size = newSize;
+        }
+        ssize_t numRead = read(task->outFd, task->out + task->length, task->size - task->length);
+        if (numRead > 0) {
+          task->length += numRead;
+          continue;
+        }
+        if (numRead == 0 || (errno != EAGAIN && errno != EINTR)) {
+          // task closed its output
+          close(task->outFd);
+          task->outFd = -1;
+        }
+        break;
+      }
+      if (!task->exited && claimChild(task->pid, &task->status) != 0) {
+        task->exited = 1;
+      }
+      if (task->exited && task->outFd < 0) {
+        // done, hand over output and free the slot
+        if (!WIFEXITED(task->status) || WEXITSTATUS(task->status) != 0) {
+          numFailed++;
+        }
+        printTask(task, keepOrder, &waiting, &numWaiting, &waitingSize, &nextToPrint, finishTask, ctx);
+        task->pid = 0;
+        numRunning--;
+      }
+    }
+  }
+  free(waiting);
+  return numFailed;
+}
+
+/*
+  Runs a script with up to maxRunning lines at once. Lines that run
+  builtins or start background jobs change or look at quash's own state,
+  so they are barriers: every line before them finishes first, they run in
+  quash itself, and only then are later lines started. Output of each
+  line is printed in script order, prefixed with its line number.
+  @param maxRunning: most lines to run at once
+  @return: 0 if every line succeeded, 1 otherwise
+*/
+int execScriptParallel(int maxRunning)
+{
+  struct scriptRun run = { 0 };
+  while (1) {
+    run.numStarted = 0;
+    arenaReset(&run.textArena);
+    runTaskPool(maxRunning, 1, startScriptLine, finishScriptLine, &run);
+    if (!run.barrier) {
+      // end of script, or it could not be read
+      break;
+    }
+    int ret = execBarrierLine(&run);
+    forgetUnclaimedExits();
+    run.numLines++;
+    if (ret != 0) {
+      addFailedLine(&run, run.lineNo, ret, run.barrier->text);
+    }
+    run.barrier = NULL;
+    if (exitRequested) {
+      break;
+    }
+  }
+
+  if (run.numFailed > 0) {
+    fflush(stdout);
+    fprintf(stderr, "%d of %d lines failed:\n", run.numFailed, run.numLines);
+    fwrite(run.failures, 1, run.failuresLength, stderr);
+  }
+  int ret = run.numFailed > 0;
+  arenaFree(&run.lineArena);
+  arenaFree(&run.textArena);
+  free(run.lines);
+  free(run.failures);
+  return ret;
+}
+
+/*
+  Starts the next line of a script running in a child, or stops the
+  batch when the next line is a barrier or the script has ended. A line
+  that is a single command is spawned directly, anything else runs in a
+  forked copy of quash.
+  @param ctx: struct scriptRun of the running script
+  @param index: task number within the batch
+  @param outFd: where the line's stdout & stderr go
+  @param pid: [out] pid of the child running the line
+  @return: 0 if started, 1 if the batch is done, negative for error
+*/
+int startScriptLine(void* ctx, int index, int outFd, pid_t* pid)
+{
+  struct scriptRun* run = ctx;
+  struct plan* plan;
+  while (1) {
+    arenaReset(&run->lineArena);
+    int ret = getCommand(&run->lineArena, &plan);
+    if (ret < 0 || (ret > 0 && input.eof && input.start == input.end)) {
+      return 1;
+    }
+    run->lineNo += run->numBodyLines + 1;
+    run->numBodyLines = 0;
+    if (ret == 0) {
+      run->numBodyLines = plan->numBodyLines;
+      break;
+    }
+  }
+  quashStats.commands++;
+  if (plan->background || !isExternalPlan(plan)) {
+    // finish everything before it, then run it in quash
+    run->barrier = plan;
+    return 1;
+  }
+
+  if (index == run->size) {
+    int newSize = run->size ? run->size * 2 : 64;
+    struct scriptLine* grown = quashRealloc(run->lines, newSize * sizeof(struct scriptLine));
+    if (!grown) {
+      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+      return -1;
+    }
+    run->lines = grown;
+    run->size = newSize;
+  }
+  run->lines[index].lineNo = run->lineNo;
+  run->lines[index].text = arenaStrdup(&run->textArena, plan->text);
+  run->numStarted++;
+  run->numLines++;
+
+  struct stage* stage = &plan->stages[0];
+  if (plan->numStages == 1 && stage->numRedirects == 0 && !stage->placement
+      && !plan->schedClass && !plan->timed) {
+    // a lone command needs nothing from quash in the child, so skip the fork
+    quashStats.external++;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, outFd, STDERR_FILENO);
+    int ret = spawnCommand(stage->argv, &actions, pid);
+    posix_spawn_file_actions_destroy(&actions);
+    return ret == 0 ? 0 : -1;
+  }
+  fflush(stdout);
+  fflush(stderr);
+  *pid = fork();
+  if (*pid < 0) {
+    fprintf(stderr, "\nError forking line %d. Error:%d\n", run->lineNo, errno);
+    return -1;
+  }
+  if (*pid == 0) {
+    dup2(outFd, STDOUT_FILENO);
+    dup2(outFd, STDERR_FILENO);
+    closeUnusedCoprocs(plan);
+    int ret = execCommand(plan);
+    fflush(stdout);
+    _exit(ret & 0xff);
+  }
+  return 0;
+}
+
+/*
+  Prints a finished line's output with its line number on every line of
+  it, and remembers the line if it failed
+  @param ctx: struct scriptRun of the running script
+  @param index: task number within the batch
+  @param status: status of the child that ran the line
+  @param out: everything the line printed
+  @param length: length of out
+*/
+void finishScriptLine(void* ctx, int index, int status, char* out, size_t length)
+{
+  struct scriptRun* run = ctx;
+  int lineNo;
+  char* text;
+  if (index < run->numStarted && run->lines) {
+    lineNo = run->lines[index].lineNo;
+    text = run->lines[index].text;
+  }
+  else {
+    // could not be started
+    lineNo = run->lineNo;
+    text = "";
+  }
+  printLineOutput(lineNo, out, length);
+  int ret = exitCode(status);
+  if (ret != 0) {
+    addFailedLine(run, lineNo, ret, text);
+  }
+}
+
+/*
+  Prints what a line of a script printed with its line number on every
+  line of it
+  @param lineNo: line number
+  @param out: everything the line printed
+  @param length: length of out
+*/
+void printLineOutput(int lineNo, char* out, size_t length)
+{
+  size_t start = 0;
+  while (start < length) {
+    char* newline = memchr(out + start, '\n', length - start);
+    size_t end = newline ? (size_t) (newline - out) : length;
+    printf("%d: %.*s\n", lineNo, (int) (end - start), out + start);
+    start = end + 1;
+  }
+  fflush(stdout);
+}
+
+/*
+  Runs a barrier line of a script in quash itself, its output captured
+  in a memory file and printed with its line number like the output of
+  lines run in parallel. A line that starts a job (& or coproc) writes
+  straight through, as the job keeps writing after the line is done.
+  @param run: running script, its barrier is the line to run
+  @return: exit status of the line
+*/
+int execBarrierLine(struct scriptRun* run)
+{
+  struct plan* plan = run->barrier;
+  const struct builtin* builtin = findBuiltin(plan->stages[0].argv[0]);
+  if (plan->background || builtin == &builtins[BUILTIN_COPROC]) {
+    return execCommand(plan);
+  }
+  int fd = makeMemoryFile("quash-line");
+  if (fd < 0) {
+    fprintf(stderr, "\nError capturing line %d. Error:%d\n", run->lineNo, errno);
+    return execCommand(plan);
+  }
+  fflush(stdout);
+  fflush(stderr);
+  int savedOut = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+  int savedErr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+  dup2(fd, STDOUT_FILENO);
+  dup2(fd, STDERR_FILENO);
+
+  int ret = execCommand(plan);
+
+  fflush(stdout);
+  fflush(stderr);
+  dup2(savedOut, STDOUT_FILENO);
+  dup2(savedErr, STDERR_FILENO);
+  close(savedOut);
+  close(savedErr);
+  off_t length = lseek(fd, 0, SEEK_END);
+  if (length > 0) {
+    char* out = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (out == MAP_FAILED) {
+      fprintf(stderr, "\nError reading output of line %d. Error:%d\n", run->lineNo, errno);
+    }
+    else {
+      printLineOutput(run->lineNo, out, length);
+      munmap(out, length);
+    }
+  }
+  close(fd);
+  return ret;
+}
+
+/*
+  Adds a line to the summary of failed lines printed when a script ends
+  @param run: running script
+  @param lineNo: line number
+  @param ret: exit status of the line
+  @param text: the line
+*/
+void addFailedLine(struct scriptRun* run, int lineNo, int ret, char* text)
+{
+  run->numFailed++;
+  char entry[512];
+  int length = snprintf(entry, sizeof(entry), "  line %d (exit %d): %s\n", lineNo, ret, text);
+  if (length >= (int) sizeof(entry)) {
+    length = sizeof(entry) - 1;
+    entry[length - 1] = '\n';
+  }
+  if (run->failuresLength + length > run->failuresSize) {
+    size_t newSize = run->failuresSize ? run->failuresSize * 2 : 4096;
+    char* grown = quashRealloc(run->failures, newSize);
+    if (!grown) {
+      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+      return;
+    }
+    run->failures = grown;
+    run->failuresSize = newSize;
+  }
+  memcpy(run->failures + run->failuresLength, entry, length);
+  run->failuresLength += length;
+}
+
+/*
+  Checks that no stage of a plan is a builtin
+  @param plan: plan to check
+  @return: 1 if every stage runs an external command, 0 otherwise
+*/
+int isExternalPlan(struct plan* plan)
+{
+  int i = 0;
+  for (; i < plan->numStages; ++i) {
+    if (isBuiltin(plan->stages[i].argv[0])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+  Prints a finished task's output, holding it back when keeping order
+  until every earlier task has been printed
+  @param task: finished task, its output is freed once printed
+  @param keepOrder: print in task order
+  @param waiting: [in/out] tasks finished out of order, grown as needed
+  @param numWaiting: [in/out] number of tasks in waiting
+  @param waitingSize: [in/out] number of tasks waiting has room for
+  @param nextToPrint: [in/out] index of next task to print when keeping order
+  @param finishTask: callback from runTaskPool, NULL to write to stdout
+  @param ctx: passed to finishTask
+*/
+void printTask(struct task* task, int keepOrder, struct task** waiting, int* numWaiting, int* waitingSize, int* nextToPrint,
+               void (*finishTask)(void* ctx, int index, int status, char* out, size_t length), void* ctx)
+{
+  if (keepOrder && task->index != *nextToPrint) {
+    // a slow task holds back any number of later ones
+    if (*numWaiting == *waitingSize) {
+      int newSize = *waitingSize ? *waitingSize * 2 : 16;
+      struct task* grown = quashRealloc(*waiting, newSize * sizeof(struct task));
+      if (!grown) {
+        fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+        free(task->out);
+        return;
+      }
+      *waiting = grown;
+      *waitingSize = newSize;
+    }
+    (*waiting)[(*numWaiting)++] = *task;
+    return;
+  }
+  // the next task to print is copied out of waiting, which it is removed from
+  struct task next;
+  while (1) {
+    if (finishTask) {
+      finishTask(ctx, task->index, task->status, task->out, task->length);
+    }
+    else if (task->length > 0) {
+      fflush(stdout);
+      write(STDOUT_FILENO, task->out, task->length);
+    }
+    free(task->out);
+    (*nextToPrint)++;
+    if (!keepOrder) {
+      return;
+    }
+    // print any later tasks that were waiting on this one
+    int i;
+    for (i = 0; i < *numWaiting; ++i) {
+      if ((*waiting)[i].index == *nextToPrint) {
+        break;
+      }
+    }
+    if (i == *numWaiting) {
+      return;
+    }
+    next = (*waiting)[i];
+    (*waiting)[i] = (*waiting)[--(*numWaiting)];
+    task = &next;
+  }
+}
+
+/*
+  Adds a running background job to the job table, reusing the slot and id
+  of a finished job when there is one
+  @param pids: every process in the job, the last one is shown as its pid
+  @param numPids: number of processes
+  @param text: command line the job is running
+  @return: job id of the new job, negative for error
+*/
+int addJob(pid_t pids[], int numPids, char* text)
+{
+  if (jobTable.numFree == 0 && jobTable.used == jobTable.size) {
+    // table is full, double size
+    int newSize = jobTable.size ? jobTable.size * 2 : 64;
+    struct job* grownJobs = quashRealloc(jobTable.jobs, newSize * sizeof(struct job));
+    if (!grownJobs) {
+      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+      return -1;
+    }
+    jobTable.jobs = grownJobs;
+    int* grownFree = quashRealloc(jobTable.freeIds, newSize * sizeof(int));
+    if (!grownFree) {
+      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+      return -1;
+    }
+    jobTable.freeIds = grownFree;
+    jobTable.size = newSize;
+  }
+  if ((jobTable.numPidSlotsUsed + numPids) * 2 > jobTable.numPidSlots && growPidIndex(numPids) != 0) {
+    return -1;
+  }
+
+  pid_t* jobPids = quashMalloc(numPids * sizeof(pid_t));
+  if (!jobPids) {
+    fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+    return -1;
+  }
+  memcpy(jobPids, pids, numPids * sizeof(pid_t));
+
+  int jobid = (jobTable.numFree > 0) ? jobTable.freeIds[--jobTable.numFree] : jobTable.used++;
+  struct job* newjob = &jobTable.jobs[jobid];
+  newjob->pid = pids[numPids - 1]; 
+  newjob->jobid = jobid;
+  newjob->bgcommand = quashStrdup(text);
+  newjob->finishedFlag = 0; 
+  newjob->pids = jobPids;
+  newjob->numPids = numPids;
+  newjob->numRunning = numPids;
+  newjob->status = 0;
+  newjob->started = nowNs();
+  newjob->waitedFor = 0;
+  newjob->output = NULL;
+  parseSchedClass("normal", &newjob->schedClass);
+
+  // index by pid
+  int i;
+  for (i = 0; i < numPids; ++i) {
+    indexPid(pids[i], jobid);
+  }
+
+  // append to list of running jobs
+  newjob->nextActive = -1;
+  newjob->prevActive = jobTable.activeTail;
+  if (jobTable.activeTail >= 0) {
+    jobTable.jobs[jobTable.activeTail].nextActive = jobid;
+  }
+  else {
+    jobTable.activeHead = jobid;
+  }
+  jobTable.activeTail = jobid;
+  jobTable.numActive++;
+  return jobid;
+}
+
+/*
+  Finds the pid index slot holding pid, or the empty slot where it would go
+  @param pid: pid to look up
+  @return: slot index
+*/
+int findPidSlot(pid_t pid)
+{
+  int mask = jobTable.numPidSlots - 1;
+  int slot = ((unsigned int) pid * 2654435761U) >> 7 & mask;
+  // linear probing, deleted slots (-1) don't end the search
+  while (jobTable.pidSlots[slot].pid != 0 && jobTable.pidSlots[slot].pid != pid) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+/*
+  Records which job a process belongs to
+  @param pid: process id
+  @param jobid: job the process is part of
+*/
+void indexPid(pid_t pid, int jobid)
+{
+  int slot = findPidSlot(pid);
+  jobTable.pidSlots[slot].pid = pid;
+  jobTable.pidSlots[slot].jobid = jobid;
+  jobTable.numPidSlotsUsed++;
+}
+
+/*
+  Finds the running job a process belongs to
+  @param pid: pid to look up
+  @return: job id, negative if no running job has that pid
+*/
+int findJobByPid(pid_t pid)
+{
+  if (jobTable.numPidSlots == 0) {
+    return -1;
+  }
+  int slot = findPidSlot(pid);
+  return (jobTable.pidSlots[slot].pid == pid) ? jobTable.pidSlots[slot].jobid : -1;
+}
+
+/*
+  Marks a process of a job as reaped
+  @param jobid: job the process belongs to
+  @param pid: process that exited
+  @param status: status from waitpid
+  @return: 1 if that was the job's last running process, 0 otherwise
+*/
+int finishJobProcess(int jobid, pid_t pid, int status)
+{
+  struct job* job = &jobTable.jobs[jobid];
+  // leave a deleted marker so probing continues past this slot
+  jobTable.pidSlots[findPidSlot(pid)].pid = -1;
+  int i;
+  for (i = 0; i < job->numPids; ++i) {
+    if (job->pids[i] == pid) {
+      // never signal a reaped pid, it could belong to someone else now
+      job->pids[i] = 0;
+    }
+  }
+  if (pid == job->pid) {
+    job->status = status;
+  }
+  job->numRunning--;
+  return job->numRunning == 0;
+}
+
+/*
+  Removes a finished job from the table so its slot and id can be reused
+  @param jobid: id of the finished job
+*/
+void removeJob(int jobid)
+{
+  struct job* oldjob = &jobTable.jobs[jobid];
+  // unlink from list of running jobs
+  if (oldjob->prevActive >= 0) {
+    jobTable.jobs[oldjob->prevActive].nextActive = oldjob->nextActive;
+  }
+  else {
+    jobTable.activeHead = oldjob->nextActive;
+  }
+  if (oldjob->nextActive >= 0) {
+    jobTable.jobs[oldjob->nextActive].prevActive = oldjob->prevActive;
+  }
+  else {
+    jobTable.activeTail = oldjob->prevActive;
+  }
+  jobTable.numActive--;
+  if (oldjob->output) {
+    keepJobOutput(oldjob);
+  }
+
+  oldjob->finishedFlag = 1;
+  oldjob->pid = 0;
+  free(oldjob->bgcommand);
+  oldjob->bgcommand = NULL;
+  free(oldjob->pids);
+  oldjob->pids = NULL;
+  jobTable.freeIds[jobTable.numFree++] = jobid;
+}
+
+/*
+  Rebuilds the pid index with room for every running process plus
+  numNew more at under half full, dropping deleted markers
+  @param numNew: number of pids about to be added
+  @return: 0 for success, non-zero otherwise
+*/
+int growPidIndex(int numNew)
+{
+  struct pidSlot* oldSlots = jobTable.pidSlots;
+  int oldNumSlots = jobTable.numPidSlots;
+  int numLive = 0;
+  int i;
+  for (i = 0; i < oldNumSlots; ++i) {
+    if (oldSlots[i].pid > 0) {
+      numLive++;
+    }
+  }
+  int newNumSlots = 64;
+  while (newNumSlots < (numLive + numNew) * 4) {
+    newNumSlots *= 2;
+  }
+  jobTable.pidSlots = quashMalloc(newNumSlots * sizeof(struct pidSlot));
+  if (!jobTable.pidSlots) {
+    fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+    jobTable.pidSlots = oldSlots;
+    return -1;
+  }
+  memset(jobTable.pidSlots, 0, newNumSlots * sizeof(struct pidSlot));
+  jobTable.numPidSlots = newNumSlots;
+  jobTable.numPidSlotsUsed = 0;
+  for (i = 0; i < oldNumSlots; ++i) {
+    if (oldSlots[i].pid > 0) {
+      indexPid(oldSlots[i].pid, oldSlots[i].jobid);
+    }
+  }
+  free(oldSlots);
+  return 0;
+}
+
+/* 
+  Changes directory
+  @param args: command from commandline
+  @return: 0 if successful
+
+  Note: if cd is called with no additional
+  args, will go to home
+*/
+int cd(char* args[]) 
+{
+  if (args[1] == '\0') {
+    char* home = envGet("HOME");
+	  chdir(home); 
+  } 
+  else { 
+	  if (chdir(args[1])!= 0) {
+    	  	printf("cd: %s: No such file or directory\n", args[1]); 
+        return 1;
+	  }
+  } 
+  return 0;
+}
+
+//scroll through jobs, looking for all commands still active
+int jobs(char* args[]) 
+{
+  if (args[1] != NULL && strcmp(args[1], "-o") == 0) {
+    // show the tail of a job's captured output
+    char* id = args[2] ? args[2] + (args[2][0] == '%') : NULL;
+    char* end;
+    long outputId = id ? strtol(id, &end, 10) : -1;
+    int index;
+    struct outputRing* ring = (id && *end == '\0') ? findJobOutput(outputId, &index) : NULL;
+    if (!ring) {
+      fprintf(stderr, "jobs: %s: no output kept for that job\n", args[2] ? args[2] : "-o");
+      return 1;
+    }
+    drainJobOutputs();
+    printRing(ring, 0);
+    return 0;
+  }
+  int jobid = jobTable.activeHead;
+  for (; jobid >= 0; jobid = jobTable.jobs[jobid].nextActive) {
+    struct job* job = &jobTable.jobs[jobid];
+	  printf("[%d] %d (%s) %s \n", job->jobid, job->pid, job->schedClass.name, job->bgcommand); 
+	}
+  return 0;
+}
+
+/*
+  Leaves quash once the current command line is done
+  @param args: command from commandline
+  @return: 0
+*/
+int exitCMD(char* args[])
+{
+  // called through the builtin table, which passes every builtin its args
+  (void) args;
+  exitRequested = 1;
+  return 0;
+}
+
+/*
+  Sets variables in the environment of every command run from now on
+  @param args: command from commandline
+  @return: 0 if successful, 1 otherwise
+
+  Usage: export                  lists every variable
+         export NAME=value ...   sets each variable
+         export -n NAME ...      removes each variable
+  Every variable is exported, so export NAME alone does nothing.
+*/
+int exportCMD(char* args[])
+{
+  if (args[1] == NULL) {
+    char** block = envBlock();
+    int i = 0;
+    for (; block && block[i] != NULL; ++i) {
+      printf("%s\n", block[i]);
+    }
+    return 0;
+  }
+  int remove = (strcmp(args[1], "-n") == 0);
+  int ret = 0;
+  int i = 1 + remove;
+  for (; args[i] != NULL; ++i) {
+    char* equals = strchr(args[i], '=');
+    if (equals == args[i]) {
+      fprintf(stderr, "export: '%s': not a valid name\n", args[i]);
+      ret = 1;
+      continue;
+    }
+    if (remove) {
+      envUnset(args[i]);
+    }
+    else if (equals && envPut(args[i], equals - args[i], equals + 1) != 0) {
+      ret = 1;
+    }
+    if (strncmp(args[i], "PATH", 4) == 0 && (args[i][4] == '=' || args[i][4] == '\0')) {
+      // cached locations may no longer be first in the new PATH
+      clearPathCache();
+    }
+  }
+  return ret;
+}
+
+/*
+  Prints or sets PATH & HOME variables
+  @param args: command from commandline
+  @return: 0 if successful
+
+  Note: if set is called with no additional
+  args, path and home will be printed
+*/
+int set(char* args[])
+{
+  if (args[1] == NULL) {
+    // print home & path environment variables
+    char* path = envGet("PATH");
+    char* home = envGet("HOME");
+    printf("PATH:%s\n", path);
+    printf("HOME:%s\n", home);
+    if (pipeSize > 0) {
+      printf("PIPESZ:%ld\n", pipeSize);
+    }
+    else {
+      printf("PIPESZ:default\n");
+    }
+    if (jobOutputSize > 0) {
+      printf("JOBBUF:%ld\n", jobOutputSize);
+    }
+    else {
+      printf("JOBBUF:default\n");
+    }
+  }
+  else {
+    // figure out whether setting path or home
+    char* variable = strtok(args[1], "=");
+    if (variable == NULL) {
+      fprintf(stderr, "Usage: set <envVariable>=<newValue>\n");
+      return 1;
+    }
+    else if (strcmp(variable, "PATH") == 0) {
+      char* newPath = strtok(NULL, "=");
+      if (newPath == NULL) {
+        fprintf(stderr, "Usage: set <envVariable>=<newValue>\n");
+        return 1;
+      }
+      envSet(variable, newPath);
+      // cached locations may no longer be first in the new PATH
+      clearPathCache();
+    }
+    else if (strcmp(variable, "HOME") == 0) {
+      char* newHome = strtok(NULL, "=");
+      if (newHome == NULL) {
+                fprintf(stderr, "Usage: set <envVariable>=<newValue>\n");
+        return 1;
+      }
+      envSet(variable, newHome);
+    }
+    else if (strcmp(variable, "PIPESZ") == 0) {
+      char* newSize = strtok(NULL, "=");
+      long size = newSize ? parseSize(newSize) : -1;
+      if (size < 0) {
+        fprintf(stderr, "Usage: set PIPESZ=<bytes>[K|M|G] or set PIPESZ=default\n");
+        return 1;
+      }
+      pipeSize = size;
+    }
+    else if (strcmp(variable, "JOBBUF") == 0) {
+      char* newSize = strtok(NULL, "=");
+      long size = newSize ? parseSize(newSize) : -1;
+      if (size < 0) {
+        fprintf(stderr, "Usage: set JOBBUF=<bytes>[K|M|G] or set JOBBUF=default\n");
+        return 1;
+      }
+#ifndef __linux__
+      if (size > 0) {
+        fprintf(stderr, "set: JOBBUF is not supported on this system\n");
+        return 1;
+      }
+#endif
+      jobOutputSize = size;
+    }
+    else {
+      fprintf(stderr, "set can be used for PATH, HOME, PIPESZ or JOBBUF\n");
+      return 1;
     }
   }
   return 0;
@@ -980,42 +5178,893 @@ int set(char* args[])
   @param args: command from commandline
   @return: 0 if successful
 */
-int killCMD(char** args)
+int killCMD(char** args)
+{
+  //if no arguments, print error
+  if (args[1] == NULL) {
+    printf("Error: two inputs expected, none recieved \n");
+    return 1; 
+  }
+  else {
+    //if one argument, print error
+    if (args[2] == NULL) {
+      printf("Error: two inputs expected, one recieved \n"); 
+      return 1; 
+    }
+    else {
+      //convert args to ints
+		  int jobNumber = -1; 
+		  sscanf(args[2], "%d", &jobNumber); 
+		  int killSig; 
+		  sscanf(args[1], "%d", &killSig); 
+
+      //if job select is not empty, proceed
+		  if (jobNumber >= 0 && jobNumber < jobTable.used && !jobTable.jobs[jobNumber].finishedFlag) {
+        //just a warning about a 0 kill signal
+        if (killSig == 0) {
+				  printf("Kill signal of 0 will not kill process\n");
+        }
+        //kill every process of the job still running
+        struct job* job = &jobTable.jobs[jobNumber];
+        int i;
+        for (i = 0; i < job->numPids; ++i) {
+          if (job->pids[i] > 0) {
+            kill(job->pids[i], killSig); 
+          }
+        }
+		  }
+      //if process does not exist print error
+		  else {
+        printf("Error: process does not exist \n"); 
+        return 1; 
+		  }
+    }
+  }  	
+  return 0; 
+}
+
+/*
+  Waits for background jobs to finish
+  @param args: command from commandline
+  @return: exit status of the last job waited for, 127 if it is not a
+    job, 128 + SIGINT if interrupted
+
+  Usage: wait              waits for every running job, returns 0
+         wait ID ...       waits for each job (%N is a job id, N is a pid
+                           of a job if there is one, else a job id)
+         wait -n [ID ...]  waits for the first of them (default: any job)
+  Blocks on the child event fd, never polls in a loop. Jobs that finished
+  before wait was called still give back their exit status.
+*/
+int waitCMD(char* args[])
+{
+  int first = 0;
+  int i = 1;
+  if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+    first = 1;
+    i++;
+  }
+  int numTargets = 0;
+  while (args[i + numTargets] != NULL) {
+    numTargets++;
+  }
+  // anything that already exited is marked finished before looking up jobs
+  reapChildren();
+  int all = (numTargets == 0);
+  if (all) {
+    // every running job
+    numTargets = jobTable.numActive;
+  }
+  struct waitTarget* targets = quashMalloc((numTargets + 1) * sizeof(struct waitTarget));
+  if (!targets) {
+    fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+    return 1;
+  }
+
+  // find each target, marking the running ones so recordExit fills them in
+  waitState.targets = targets;
+  waitState.numTargets = numTargets;
+  waitState.remaining = 0;
+  waitState.firstDone = -1;
+  int jobid = jobTable.activeHead;
+  int t = 0;
+  for (; t < numTargets; ++t) {
+    struct waitTarget* target = &targets[t];
+    target->done = 0;
+    target->status = 0;
+    if (all) {
+      target->jobid = jobid;
+      jobid = jobTable.jobs[jobid].nextActive;
+    }
+    else {
+      // a finished job is only found once, later mentions of it copy the first
+      int earlier = 0;
+      for (; earlier < t && strcmp(args[i + earlier], args[i + t]) != 0; ++earlier) {}
+      if (earlier < t) {
+        *target = targets[earlier];
+        continue;
+      }
+      target->jobid = findWaitTarget(args[i + t], target);
+    }
+    if (target->jobid < 0) {
+      // finished already, or never was a job
+      target->done = 1;
+      if (first && waitState.firstDone < 0) {
+        waitState.firstDone = t;
+      }
+      continue;
+    }
+    struct job* job = &jobTable.jobs[target->jobid];
+    target->pid = job->pid;
+    if (job->waitedFor == 0) {
+      job->waitedFor = t + 1;
+      waitState.remaining++;
+    }
+  }
+  if (first && numTargets == 0) {
+    // nothing to wait for
+    waitState.targets = NULL;
+    free(targets);
+    return 127;
+  }
+
+  //control-c stops waiting but not quash
+  signal(SIGINT, preventProgramKill);
+  int interrupted = 0;
+  while (waitState.remaining > 0 && !(first && waitState.firstDone >= 0)) {
+    // sleep until a child exits, one that exits after reapChildren still wakes us,
+    // draining the output of jobs meanwhile so they never block writing it
+    struct pollfd fds[2] = { { childEventFd, POLLIN, 0 }, { jobOutputEpollFd, POLLIN, 0 } };
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        interrupted = 1;
+        break;
+      }
+      fprintf(stderr, "\nError waiting for jobs. Error:%d\n", errno);
+      break;
+    }
+    if (fds[1].revents) {
+      drainJobOutputs();
+    }
+    reapChildren();
+  }
+  signal(SIGINT, allowProgramKill);
+
+  // jobs still running are no longer waited for
+  for (t = 0; t < numTargets; ++t) {
+    if (!targets[t].done && targets[t].jobid >= 0) {
+      jobTable.jobs[targets[t].jobid].waitedFor = 0;
+    }
+  }
+  int ret = 0;
+  if (interrupted) {
+    ret = 128 + SIGINT;
+  }
+  else if (first) {
+    ret = targets[waitState.firstDone].status;
+  }
+  else if (!all) {
+    ret = targets[numTargets - 1].status;
+  }
+  waitState.targets = NULL;
+  free(targets);
+  return ret;
+}
+
+/*
+  Looks up a job for wait
+  @param arg: %N for a job id, N for the pid of any process in a job,
+    or a job id when no job has that pid
+  @param target: [out] exit status when the job has already finished
+  @return: id of the running job, negative if it is not running
+*/
+int findWaitTarget(char* arg, struct waitTarget* target)
+{
+  int byJobId = (arg[0] == '%');
+  char* end;
+  long id = strtol(arg + byJobId, &end, 10);
+  if (end == arg + byJobId || *end != '\0' || id < 0) {
+    fprintf(stderr, "wait: %s: not a job id or pid\n", arg);
+    target->status = 127;
+    return -1;
+  }
+  // a bare number is a pid when there is a job with that pid, running or
+  // finished before anyone waited for it, and only otherwise a job id
+  int jobid = -1;
+  if (!byJobId && id > 0 && (jobid = findJobByPid(id)) >= 0) {
+    return jobid;
+  }
+  if (!byJobId && takeFinishedJob(id, 0, target)) {
+    return -1;
+  }
+  if (id < jobTable.used && !jobTable.jobs[id].finishedFlag) {
+    return id;
+  }
+  if (takeFinishedJob(id, 1, target)) {
+    return -1;
+  }
+  fprintf(stderr, "wait: %s: no such job\n", arg);
+  target->status = 127;
+  return -1;
+}
+
+/*
+  Takes the exit status of a job that finished before anyone waited for it
+  @param id: pid or job id of the job
+  @param byJobId: id is a job id rather than a pid
+  @param target: [out] exit status of the job
+  @return: 1 if the job was found, 0 otherwise
+*/
+int takeFinishedJob(long id, int byJobId, struct waitTarget* target)
+{
+  int i = finishedJobs.count - 1;
+  for (; i >= 0; --i) {
+    struct finishedJob* record = &finishedJobs.records[i];
+    if ((byJobId ? record->jobid : record->pid) == id) {
+      target->status = exitCode(record->status);
+      finishedJobs.records[i] = finishedJobs.records[--finishedJobs.count];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+  Keeps the exit status of a background job nobody was waiting for, so a
+  later wait can still return it. Only the most recent MAX_FINISHED_JOBS
+  are kept.
+  @param job: job that just finished
+*/
+void rememberFinishedJob(struct job* job)
+{
+  if (finishedJobs.count == MAX_FINISHED_JOBS) {
+    // forget the older half
+    int half = MAX_FINISHED_JOBS / 2;
+    memmove(finishedJobs.records, finishedJobs.records + half, (finishedJobs.count - half) * sizeof(struct finishedJob));
+    finishedJobs.count -= half;
+  }
+  if (finishedJobs.count == finishedJobs.size) {
+    int newSize = finishedJobs.size ? finishedJobs.size * 2 : 64;
+    struct finishedJob* grown = quashRealloc(finishedJobs.records, newSize * sizeof(struct finishedJob));
+    if (!grown) {
+      fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+      return;
+    }
+    finishedJobs.records = grown;
+    finishedJobs.size = newSize;
+  }
+  struct finishedJob* record = &finishedJobs.records[finishedJobs.count++];
+  record->jobid = job->jobid;
+  record->pid = job->pid;
+  record->status = job->status;
+}
+
+/*
+  Changes the scheduling class of running jobs
+  @param args: command from commandline
+  @return: 0 if successful, 1 otherwise
+
+  Usage: bg-class CLASS ID ...   (%N or N is a job id)
+  A job can also be started in a class with bg-class CLASS cmd ... &,
+  see parseSchedClass for the classes. Only root can raise a job's
+  priority again once it has been lowered.
+*/
+int bgClassCMD(char* args[])
+{
+  struct schedClass schedClass;
+  if (args[1] == NULL || args[2] == NULL) {
+    fprintf(stderr, "Usage: bg-class CLASS ID ...  or  bg-class CLASS cmd ... &\n");
+    return 1;
+  }
+  if (parseSchedClass(args[1], &schedClass) != 0) {
+    fprintf(stderr, "bg-class: unknown class '%s'\n", args[1]);
+    return 1;
+  }
+  int ret = 0;
+  int i = 2;
+  for (; args[i] != NULL; ++i) {
+    char* id = args[i] + (args[i][0] == '%');
+    char* end;
+    long jobid = strtol(id, &end, 10);
+    if (end == id || *end != '\0' || jobid < 0 || jobid >= jobTable.used || jobTable.jobs[jobid].finishedFlag) {
+      fprintf(stderr, "bg-class: %s: no such job\n", args[i]);
+      ret = 1;
+      continue;
+    }
+    struct job* job = &jobTable.jobs[jobid];
+    int j;
+    for (j = 0; j < job->numPids; ++j) {
+      if (job->pids[j] > 0 && applySchedClass(job->pids[j], &schedClass) != 0) {
+        ret = 1;
+      }
+    }
+    job->schedClass = schedClass;
+  }
+  return ret;
+}
+
+/*
+  Starts a process quash keeps a pipe to and from, for helpers that
+  would otherwise be started again for every line that uses them
+  @param args: command from commandline
+  @return: 0 if successful, 1 otherwise
+
+  Usage: coproc NAME cmd ...   starts cmd as the coproc NAME, a job
+         coproc -c NAME        closes its input so it sees end of file
+         coproc                lists coprocs
+  Commands write to it with >&NAME and read its output with <&NAME.
+*/
+int coprocCMD(char* args[])
+{
+  if (args[1] == NULL) {
+    int i = 0;
+    for (; i < coprocTable.count; ++i) {
+      struct coproc* coproc = &coprocTable.coprocs[i];
+      printf("%s %d %s\n", coproc->name, coproc->pid,
+             coproc->pid > 0 ? (coproc->toFd >= 0 ? "running" : "input closed") : "finished");
+    }
+    return 0;
+  }
+  if (strcmp(args[1], "-c") == 0) {
+    struct coproc* coproc = args[2] ? findCoproc(args[2]) : NULL;
+    if (!coproc) {
+      fprintf(stderr, "coproc: %s: no such coproc\n", args[2] ? args[2] : "");
+      return 1;
+    }
+    if (coproc->toFd >= 0) {
+      close(coproc->toFd);
+      coproc->toFd = -1;
+    }
+    return 0;
+  }
+  if (args[2] == NULL) {
+    fprintf(stderr, "Usage: coproc NAME cmd ...  or  coproc -c NAME\n");
+    return 1;
+  }
+  struct coproc* coproc = findCoproc(args[1]);
+  if (coproc && coproc->pid > 0) {
+    fprintf(stderr, "coproc: %s is already running\n", args[1]);
+    return 1;
+  }
+
+  // toChild carries what commands write to it, fromChild what it prints
+  int toChild[2];
+  int fromChild[2];
+  if (makePipe(toChild) < 0) {
+    fprintf(stderr, "\nError creating pipe. Error:%d\n", errno);
+    return 1;
+  }
+  if (makePipe(fromChild) < 0) {
+    fprintf(stderr, "\nError creating pipe. Error:%d\n", errno);
+    close(toChild[0]);
+    close(toChild[1]);
+    return 1;
+  }
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, toChild[0], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, fromChild[1], STDOUT_FILENO);
+  pid_t pid;
+  int ret = spawnCommand(args + 2, &actions, &pid);
+  posix_spawn_file_actions_destroy(&actions);
+  close(toChild[0]);
+  close(fromChild[1]);
+  if (ret != 0) {
+    close(toChild[1]);
+    close(fromChild[0]);
+    return 1;
+  }
+
+  // tracked as a job so jobs, kill & wait see it like any other
+  char text[256];
+  int length = 0;
+  int i = 0;
+  for (; args[i] != NULL && length < (int) sizeof(text); ++i) {
+    length += snprintf(text + length, sizeof(text) - length, i ? " %s" : "%s", args[i]);
+  }
+  int jobid = addJob(&pid, 1, text);
+
+  if (!coproc) {
+    if (coprocTable.count == coprocTable.size) {
+      int newSize = coprocTable.size ? coprocTable.size * 2 : 8;
+      struct coproc* grown = quashRealloc(coprocTable.coprocs, newSize * sizeof(struct coproc));
+      if (!grown) {
+        fprintf(stderr, "\nAllocation error, Error:%d\n", errno);
+        close(toChild[1]);
+        close(fromChild[0]);
+        return 1;
+      }
+      coprocTable.coprocs = grown;
+      coprocTable.size = newSize;
+    }
+    coproc = &coprocTable.coprocs[coprocTable.count++];
+    coproc->name = quashStrdup(args[1]);
+  }
+  else if (coproc->fromFd >= 0) {
+    // output of the finished coproc of the same name nobody read
+    close(coproc->fromFd);
+  }
+  coproc->pid = pid;
+  coproc->toFd = toChild[1];
+  coproc->fromFd = fromChild[0];
+  if (jobid >= 0) {
+    printf("[%d] %d running in background\n", jobid, pid);
+  }
+  return 0;
+}
+
+/*
+  Finds a coproc by name
+  @param name: name given to coproc
+  @return: the coproc, NULL if there is none with that name
+*/
+struct coproc* findCoproc(const char* name)
+{
+  int i = 0;
+  for (; i < coprocTable.count; ++i) {
+    if (strcmp(coprocTable.coprocs[i].name, name) == 0) {
+      return &coprocTable.coprocs[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+  Closes the input of a coproc that exited. Its output is kept open so
+  whatever it printed before exiting can still be read.
+  @param pid: pid of the process that exited
+*/
+void finishCoproc(pid_t pid)
+{
+  int i = 0;
+  for (; i < coprocTable.count; ++i) {
+    struct coproc* coproc = &coprocTable.coprocs[i];
+    if (coproc->pid == pid) {
+      if (coproc->toFd >= 0) {
+        close(coproc->toFd);
+        coproc->toFd = -1;
+      }
+      coproc->pid = 0;
+      return;
+    }
+  }
+}
+
+/*
+  Closes the coproc pipes a forked copy of quash inherited, so one still
+  running does not keep a coproc's input open after coproc -c. Coprocs
+  the plan redirects to or from are left open for it.
+  @param plan: plan the forked child is about to run
+*/
+void closeUnusedCoprocs(struct plan* plan)
+{
+  int i = 0;
+  for (; i < coprocTable.count; ++i) {
+    struct coproc* coproc = &coprocTable.coprocs[i];
+    int used = 0;
+    int j, k;
+    for (j = 0; j < plan->numStages && !used; ++j) {
+      struct stage* stage = &plan->stages[j];
+      for (k = 0; k < stage->numRedirects && !used; ++k) {
+        used = stage->redirects[k].kind == REDIRECT_COPROC && strcmp(stage->redirects[k].path, coproc->name) == 0;
+      }
+    }
+    if (used) {
+      continue;
+    }
+    if (coproc->toFd >= 0) {
+      close(coproc->toFd);
+      coproc->toFd = -1;
+    }
+    if (coproc->fromFd >= 0) {
+      close(coproc->fromFd);
+      coproc->fromFd = -1;
+    }
+  }
+}
+
+/*
+  Brings a background job to the foreground: prints the output kept for
+  it so far, then shows the rest as it is written until the job is done
+  @param args: command from commandline
+  @return: exit status of the job
+
+  Usage: fg [ID]   ID is %N or N for a job id, the newest job by default
+*/
+int fgCMD(char* args[])
+{
+  char current[32];
+  char* id = args[1];
+  if (id == NULL) {
+    if (jobTable.activeTail < 0) {
+      fprintf(stderr, "fg: no current job\n");
+      return 1;
+    }
+    snprintf(current, sizeof(current), "%%%d", jobTable.activeTail);
+    id = current;
+  }
+  char* end;
+  long jobid = strtol(id + (id[0] == '%'), &end, 10);
+  if (end == id + (id[0] == '%') || *end != '\0') {
+    fprintf(stderr, "fg: %s: no such job\n", id);
+    return 1;
+  }
+  drainJobOutputs();
+  int index;
+  struct outputRing* ring = findJobOutput(jobid, &index);
+  if (ring) {
+    printRing(ring, 1);
+    if (index >= 0) {
+      // finished, nothing more will come
+      freeRing(ring);
+      keptOutputs.rings[index] = keptOutputs.rings[--keptOutputs.count];
+    }
+    else {
+      ring->attached = 1;
+    }
+  }
+  if (jobid >= 0 && jobid < jobTable.used && !jobTable.jobs[jobid].finishedFlag) {
+    printf("%s\n", jobTable.jobs[jobid].bgcommand);
+  }
+  char* waitArgs[] = { "wait", id, NULL };
+  int ret = waitCMD(waitArgs);
+  if (ring && index < 0 && !jobTable.jobs[jobid].finishedFlag && jobTable.jobs[jobid].output == ring) {
+    // interrupted, the job goes on in the background
+    ring->attached = 0;
+  }
+  return ret;
+}
+
+/*
+  Shows or edits the cache of command locations
+  @param args: command from commandline
+  @return: 0 if successful
+
+  Note: with no args, prints each cached command with its hit count and the
+  overall hit/miss counters. "hash -r" empties the cache and
+  "hash name ..." looks up and remembers each name
+*/
+int hashCMD(char* args[])
 {
-  //if no arguments, print error
   if (args[1] == NULL) {
-    printf("Error: two inputs expected, none recieved \n");
-    return 1; 
+    printf("hits\tcommand\n");
+    int i;
+    for (i = 0; i < pathCache.numBuckets; ++i) {
+      struct pathEntry* entry = pathCache.buckets[i];
+      for (; entry != NULL; entry = entry->next) {
+        printf("%4ld\t%s\n", entry->hits, entry->path);
+      }
+    }
+    printf("cache hits: %ld, misses: %ld, entries: %d\n", pathCache.hits, pathCache.misses, pathCache.count);
+    return 0;
+  }
+  if (strcmp(args[1], "-r") == 0) {
+    clearPathCache();
+    return 0;
+  }
+  int ret = 0;
+  int i;
+  for (i = 1; args[i] != NULL; ++i) {
+    if (lookupCommandPath(args[i]) == NULL) {
+      fprintf(stderr, "hash: %s: not found\n", args[i]);
+      ret = 1;
+    }
+  }
+  return ret;
+}
+
+/*
+  Prints quash's own counters and latency histograms, to tell whether
+  time goes to the shell or to the commands it runs.
+  'stats' prints text, 'stats json' prints JSON and 'stats reset' clears
+  everything.
+  @param args: arguments of the builtin
+  @return: 0 if successful, 1 for bad arguments
+*/
+int statsCMD(char** args)
+{
+  if (args[1] != NULL && strcmp(args[1], "reset") == 0) {
+    memset(&quashStats, 0, sizeof(quashStats));
+    planCache.hits = 0;
+    planCache.misses = 0;
+    return 0;
+  }
+  int json = (args[1] != NULL && strcmp(args[1], "json") == 0);
+  if (args[1] != NULL && !json) {
+    fprintf(stderr, "usage: stats [json|reset]\n");
+    return 1;
+  }
+  const char* names[NUM_HISTOGRAMS] = { "parse", "spawn", "exec_to_exit", "wait" };
+  long counters[] = {
+    quashStats.commands, quashStats.builtins, quashStats.external, quashStats.pipes,
+    quashStats.allocations, quashStats.arenaResets, planCache.hits, planCache.misses
+  };
+  const char* counterNames[] = {
+    "commands", "builtins", "external", "pipes",
+    "allocations", "arena_resets", "plan_cache_hits", "plan_cache_misses"
+  };
+  int numCounters = sizeof(counters) / sizeof(counters[0]);
+  int i, j;
+
+  if (json) {
+    printf("{\"counters\": {");
+    for (i = 0; i < numCounters; ++i) {
+      printf("%s\"%s\": %ld", i ? ", " : "", counterNames[i], counters[i]);
+    }
+    printf("}, \"histograms\": {");
+    for (i = 0; i < NUM_HISTOGRAMS; ++i) {
+      struct histogram* hist = &quashStats.histograms[i];
+      printf("%s\"%s\": {\"count\": %ld, \"sum_ns\": %lld, \"min_ns\": %lld, \"max_ns\": %lld, \"buckets\": [",
+             i ? ", " : "", names[i], hist->count, hist->sum, hist->min, hist->max);
+      int first = 1;
+      for (j = 0; j < HISTOGRAM_BUCKETS; ++j) {
+        if (hist->buckets[j] > 0) {
+          // bucket j holds samples below 2^j ns
+          printf("%s{\"lt_ns\": %lld, \"count\": %ld}", first ? "" : ", ", 1LL << j, hist->buckets[j]);
+          first = 0;
+        }
+      }
+      printf("]}");
+    }
+    printf("}}\n");
+    return 0;
+  }
+
+  for (i = 0; i < numCounters; ++i) {
+    printf("%s: %ld\n", counterNames[i], counters[i]);
+  }
+  if (quashStats.commands > 0) {
+    printf("allocations per command: %.3f\n", (double) quashStats.allocations / quashStats.commands);
+  }
+  for (i = 0; i < NUM_HISTOGRAMS; ++i) {
+    struct histogram* hist = &quashStats.histograms[i];
+    printf("\n%s: count %ld", names[i], hist->count);
+    if (hist->count == 0) {
+      printf("\n");
+      continue;
+    }
+    printf(", mean %.1fus, min %.1fus, max %.1fus\n", hist->sum / 1e3 / hist->count, hist->min / 1e3, hist->max / 1e3);
+    for (j = 0; j < HISTOGRAM_BUCKETS; ++j) {
+      if (hist->buckets[j] > 0) {
+        printf("  < %10.1fus %8ld\n", (1LL << j) / 1e3, hist->buckets[j]);
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+  Starts one task of the parallel builtin: the command template with the
+  next argument substituted for {} (or appended when there is no {})
+  @param ctx: struct parallelRun of the running builtin
+  @param index: task number
+  @param outFd: where the task's stdout & stderr go
+  @param pid: [out] pid of the started task
+  @return: 0 if started, 1 if there are no more arguments, negative for error
+*/
+int startParallelTask(void* ctx, int index, int outFd, pid_t* pid)
+{
+  struct parallelRun* run = ctx;
+  char* arg;
+  if (run->args) {
+    arg = run->args[index];
+    if (!arg) {
+      return 1;
+    }
   }
   else {
-    //if one argument, print error
-    if (args[2] == NULL) {
-      printf("Error: two inputs expected, one recieved \n"); 
-      return 1; 
+    // one argument per line
+    int length;
+    int ret;
+    do {
+      ret = readLine(run->reader, &arg, &length);
+    } while (ret == 0 && length == 0);
+    if (ret != 0) {
+      return 1;
+    }
+  }
+
+  arenaReset(&run->arena);
+  int numTemplate = 0;
+  while (run->cmdTemplate[numTemplate] != 0) {
+    numTemplate++;
+  }
+  char** cmd = arenaAlloc(&run->arena, (numTemplate + 2) * sizeof(char*));
+  if (!cmd) {
+    return -1;
+  }
+  int replaced = 0;
+  int i;
+  size_t argLength = strlen(arg);
+  for (i = 0; i < numTemplate; ++i) {
+    char* word = run->cmdTemplate[i];
+    char* brace = strstr(word, "{}");
+    if (!brace) {
+      cmd[i] = word;
+      continue;
+    }
+    // count {} so the substituted word can be allocated in one go
+    int numBraces = 0;
+    char* p;
+    for (p = brace; p; p = strstr(p + 2, "{}")) {
+      numBraces++;
+    }
+    char* out = arenaAlloc(&run->arena, strlen(word) + numBraces * argLength + 1);
+    if (!out) {
+      return -1;
+    }
+    cmd[i] = out;
+    for (p = word; (brace = strstr(p, "{}")) != NULL; p = brace + 2) {
+      memcpy(out, p, brace - p);
+      out += brace - p;
+      memcpy(out, arg, argLength);
+      out += argLength;
+    }
+    strcpy(out, p);
+    replaced = 1;
+  }
+  if (!replaced) {
+    cmd[i++] = arg;
+  }
+  cmd[i] = 0;
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, outFd, STDERR_FILENO);
+  int ret = spawnCommand(cmd, &actions, pid);
+  posix_spawn_file_actions_destroy(&actions);
+  return ret;
+}
+
+/*
+  Runs a command once per argument, several at a time
+  @param args: command from commandline
+  @return: number of runs that failed (at most 101), 0 if all succeeded
+
+  Usage: parallel [-j N] [-k] cmd [args] ::: arg1 arg2 ...
+         parallel [-j N] [-k] cmd [args] :::: file
+         parallel [-j N] [-k] cmd [args]          (arguments from stdin)
+  {} in cmd is replaced with the argument, otherwise it is appended.
+  At most N (default: number of cores) run at once and each run's output
+  is printed in one piece, in finishing order or argument order with -k.
+*/
+int parallelCMD(char* args[])
+{
+  int maxRunning = sysconf(_SC_NPROCESSORS_ONLN);
+  int keepOrder = 0;
+  int i = 1;
+  for (; args[i] != NULL && args[i][0] == '-'; ++i) {
+    if (strcmp(args[i], "-k") == 0) {
+      keepOrder = 1;
+    }
+    else if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL) {
+      maxRunning = atoi(args[++i]);
+    }
+    else if (strncmp(args[i], "-j", 2) == 0 && args[i][2] != '\0') {
+      maxRunning = atoi(args[i] + 2);
     }
     else {
-      //convert args to ints
-		  int jobNumber; 
-		  sscanf(args[2], "%d", &jobNumber); 
-		  int killSig; 
-		  sscanf(args[1], "%d", &killSig); 
+      break;
+    }
+  }
+  if (maxRunning < 1) {
+    maxRunning = 1;
+  }
+  if (args[i] == NULL || strcmp(args[i], ":::") == 0 || strcmp(args[i], "::::") == 0) {
+    fprintf(stderr, "Usage: parallel [-j N] [-k] cmd [args] [::: arg ... | :::: file]\n");
+    return 1;
+  }
 
-      //if job select is not empty, proceed
-		  if (jobArray[jobNumber].pid != 0) {
-        //just a warning about a 0 kill signal
-        if (killSig == 0) {
-				  printf("Kill signal of 0 will not kill process\n");
-        }
-        //kill process
-        int pidToKill = jobArray[jobNumber].pid; 
-        kill(pidToKill,killSig); 
-		  }
-      //if process does not exist print error
-		  else {
-        printf("Error: process does not exist \n"); 
-        return 1; 
-		  }
+  struct parallelRun run = { 0 };
+  run.cmdTemplate = args + i;
+  run.reader = &input;
+  struct lineReader fileReader;
+  int fromFile = 0;
+  if (builtinInput >= 0) {
+    // arguments come from a pipe or file rather than quash's input
+    int fd = fcntl(builtinInput, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0 || initReader(&fileReader, fd) != 0) {
+      fprintf(stderr, "\nError reading arguments. Error#%d\n", errno);
+      return 1;
     }
-  }  	
-  return 0; 
+    run.reader = &fileReader;
+    fromFile = 1;
+  }
+  for (; args[i] != NULL; ++i) {
+    if (strcmp(args[i], ":::") == 0) {
+      run.args = args + i + 1;
+      args[i] = 0;
+      break;
+    }
+    if (strcmp(args[i], "::::") == 0) {
+      if (args[i + 1] == NULL) {
+        fprintf(stderr, "parallel: :::: needs a file name\n");
+        return 1;
+      }
+      int fd = open(args[i + 1], O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        fprintf(stderr, "\nError opening %s. Error#%d\n", args[i + 1], errno);
+        return 1;
+      }
+      if (fromFile) {
+        closeReader(&fileReader);
+      }
+      if (initReader(&fileReader, fd) != 0) {
+        close(fd);
+        return 1;
+      }
+      run.reader = &fileReader;
+      fromFile = 1;
+      args[i] = 0;
+      break;
+    }
+  }
+
+  if (!run.args && !fromFile) {
+    // reading more of quash's input moves or unmaps the line the command is in
+    int numWords = 0;
+    while (run.cmdTemplate[numWords] != 0) {
+      numWords++;
+    }
+    char** copy = arenaAlloc(&run.templateArena, (numWords + 1) * sizeof(char*));
+    if (!copy) {
+      return 1;
+    }
+    for (i = 0; i < numWords; ++i) {
+      if (!(copy[i] = arenaStrdup(&run.templateArena, run.cmdTemplate[i]))) {
+        arenaFree(&run.templateArena);
+        return 1;
+      }
+    }
+    copy[numWords] = 0;
+    run.cmdTemplate = copy;
+  }
+
+  int numFailed = runTaskPool(maxRunning, keepOrder, startParallelTask, NULL, &run);
+  arenaFree(&run.arena);
+  arenaFree(&run.templateArena);
+  if (fromFile) {
+    closeReader(&fileReader);
+  }
+  else if (!run.args && interactive) {
+    // control-d ended the argument list, not the shell
+    input.eof = 0;
+  }
+  if (numFailed > 0) {
+    fprintf(stderr, "parallel: %d failed\n", numFailed);
+  }
+  return numFailed > 101 ? 101 : numFailed;
+}
+
+/*
+  Parses a size such as 65536, 256K, 1M or 1G
+  @param text: size to parse, "default" means 0
+  @return: size in bytes, negative if text is not a size
+*/
+long parseSize(const char* text)
+{
+  if (strcmp(text, "default") == 0) {
+    return 0;
+  }
+  char* end;
+  long size = strtol(text, &end, 10);
+  if (end == text || size < 0) {
+    return -1;
+  }
+  switch (*end) {
+    case 'k': case 'K':
+      size <<= 10;
+      end++;
+      break;
+    case 'm': case 'M':
+      size <<= 20;
+      end++;
+      break;
+    case 'g': case 'G':
+      size <<= 30;
+      end++;
+      break;
+  }
+  return (*end == '\0') ? size : -1;
 }